@@ -0,0 +1,212 @@
+/*
+ * blkscan.c - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLKSCAN_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define BLKSCAN_NEON
+#endif
+
+#include "blkscan.h"
+#include "pcanhw.h"
+
+/*
+ * The vector kernels process the data in chunks and return the additive
+ * sum and the range of chunks containing non-EMPTY bytes. The exact first
+ * and last offsets are then looked up inside these two chunks only.
+ */
+typedef size_t (*scan_kernel_t)(const uint8_t *data, size_t len, uint16_t *csum,
+				size_t *first, size_t *last);
+
+static scan_kernel_t scan_kernel;
+
+static size_t scan_scalar(const uint8_t *data, size_t len, uint16_t *csum,
+			  size_t *first, size_t *last)
+{
+	uint16_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		sum += data[i];
+		if (data[i] != EMPTY) {
+			if (*first == SIZE_MAX)
+				*first = i;
+			*last = i + 1;
+		}
+	}
+
+	*csum += sum;
+
+	return len;
+}
+
+#ifdef BLKSCAN_X86
+
+__attribute__((target("sse2")))
+static size_t scan_sse2(const uint8_t *data, size_t len, uint16_t *csum,
+			size_t *first, size_t *last)
+{
+	const __m128i ones = _mm_set1_epi8(-1);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum = _mm_setzero_si128();
+	__m128i v;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(data + i));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xFFFF) {
+			if (*first == SIZE_MAX)
+				*first = i;
+			*last = i + 16;
+		}
+	}
+
+	*csum += _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const uint8_t *data, size_t len, uint16_t *csum,
+			size_t *first, size_t *last)
+{
+	const __m256i ones = _mm256_set1_epi8(-1);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i sum = _mm256_setzero_si256();
+	__m256i v;
+	__m128i s;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(data + i));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(v, zero));
+
+		if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones)) != 0xFFFFFFFFU) {
+			if (*first == SIZE_MAX)
+				*first = i;
+			*last = i + 32;
+		}
+	}
+
+	s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	*csum += _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(s, s));
+
+	return i;
+}
+
+#endif /* BLKSCAN_X86 */
+
+#ifdef BLKSCAN_NEON
+
+static size_t scan_neon(const uint8_t *data, size_t len, uint16_t *csum,
+			size_t *first, size_t *last)
+{
+	/* the checksum is modulo 2^16 - so the 16 bit lanes may wrap */
+	uint16x8_t sum = vdupq_n_u16(0);
+	uint8x16_t v;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = vld1q_u8(data + i);
+		sum = vpadalq_u8(sum, v);
+
+		if (vminvq_u8(v) != EMPTY) {
+			if (*first == SIZE_MAX)
+				*first = i;
+			*last = i + 16;
+		}
+	}
+
+	*csum += vaddvq_u16(sum);
+
+	return i;
+}
+
+#endif /* BLKSCAN_NEON */
+
+__attribute__((constructor))
+static void scan_init(void)
+{
+	scan_kernel = scan_scalar;
+
+#ifdef BLKSCAN_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2"))
+		scan_kernel = scan_sse2;
+	if (__builtin_cpu_supports("avx2"))
+		scan_kernel = scan_avx2;
+#endif
+#ifdef BLKSCAN_NEON
+	scan_kernel = scan_neon;
+#endif
+}
+
+/* test for EMPTY content and build the additive checksum in one pass */
+void scan_block(const uint8_t *data, size_t len, blkscan_t *res)
+{
+	size_t first = SIZE_MAX;
+	size_t last = 0;
+	size_t done, tfirst = SIZE_MAX, tlast = 0;
+	uint16_t csum = 0;
+
+	done = scan_kernel(data, len, &csum, &first, &last);
+
+	/* remaining bytes behind the last complete chunk */
+	scan_scalar(data + done, len - done, &csum, &tfirst, &tlast);
+	if (tfirst != SIZE_MAX) {
+		if (first == SIZE_MAX)
+			first = done + tfirst;
+		last = done + tlast;
+	}
+
+	res->csum = csum;
+	res->empty = (first == SIZE_MAX);
+
+	if (res->empty) {
+		res->first = len;
+		res->last = len;
+		return;
+	}
+
+	/* exact offsets inside the first and last non-EMPTY chunks */
+	while (data[first] == EMPTY)
+		first++;
+
+	while (data[last - 1] == EMPTY)
+		last--;
+
+	res->first = first;
+	res->last = last - 1;
+}
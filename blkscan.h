@@ -0,0 +1,43 @@
+/*
+ * blkscan.h - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __BLKSCANH__
+#define __BLKSCANH__
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+	int empty; /* all bytes are EMPTY / 0xFFU */
+	uint16_t csum; /* additive checksum */
+	size_t first; /* offset of the first non-EMPTY byte (len when empty) */
+	size_t last; /* offset of the last non-EMPTY byte (len when empty) */
+} blkscan_t;
+
+void scan_block(const uint8_t *data, size_t len, blkscan_t *res);
+
+#endif
@@ -0,0 +1,492 @@
+/*
+ * cache.c - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cache.h"
+
+/*
+ * The flash content of a module is stored as
+ * <dir>/<ifname>-<module id>-<hw_type>-<ppcan hw id>.bin as the ppcan hw id
+ * is not unique across the CAN buses.
+ */
+int cache_path(char *path, size_t len, const char *dir, const char *ifname,
+	       uint8_t module_id, uint8_t hw_type, uint8_t hwid)
+{
+	int ret = snprintf(path, len, "%s/%.*s-%d-%d-%d.bin", dir, IFNAMSIZ - 1, ifname,
+			   module_id, hw_type, hwid);
+
+	return (ret < 0) || (ret >= len);
+}
+
+/* open the last flashed image of a module - returns 1 when not available */
+int cache_open(image_t *img, const char *dir, const char *ifname, uint8_t module_id,
+	       uint8_t hw_type, uint8_t hwid)
+{
+	char path[256];
+
+	if (cache_path(path, sizeof(path), dir, ifname, module_id, hw_type, hwid) ||
+	    access(path, R_OK))
+		return 1;
+
+	return image_open(img, path);
+}
+
+/* store the flashed image of a module */
+int cache_store(const char *dir, const char *ifname, uint8_t module_id, uint8_t hw_type,
+		uint8_t hwid, const image_t *img)
+{
+	char path[256];
+	char tmp[264];
+	size_t done = 0;
+	ssize_t ret;
+	int fd;
+
+	if ((mkdir(dir, 0755) < 0) && (errno != EEXIST)) {
+		perror("cache directory");
+		return 1;
+	}
+
+	if (cache_path(path, sizeof(path), dir, ifname, module_id, hw_type, hwid))
+		return 1;
+
+	/* replace the old content atomically - with a unique temporary file */
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		perror("cache file");
+		return 1;
+	}
+
+	if (fchmod(fd, 0644) < 0) {
+		perror("cache file");
+		goto out_unlink;
+	}
+
+	while (done < img->len) {
+		ret = write(fd, img->data + done, img->len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("cache write");
+			goto out_unlink;
+		}
+		done += ret;
+	}
+
+	if (fsync(fd) < 0 || close(fd) < 0) {
+		perror("cache file");
+		unlink(tmp);
+		return 1;
+	}
+
+	if (rename(tmp, path) < 0) {
+		perror("cache rename");
+		unlink(tmp);
+		return 1;
+	}
+
+	return 0;
+
+out_unlink:
+	close(fd);
+	unlink(tmp);
+	return 1;
+}
+
+void desc_init(desc_cache_t *dc)
+{
+	memset(dc, 0, sizeof(*dc));
+	pthread_mutex_init(&dc->lock, NULL);
+}
+
+static int same_key(const desc_t *a, const desc_t *b)
+{
+	return !strcmp(a->ifname, b->ifname) && (a->module_id == b->module_id) &&
+		(a->hwid == b->hwid) && !memcmp(a->version, b->version, sizeof(a->version));
+}
+
+static desc_t *lookup(desc_cache_t *dc, const desc_t *key)
+{
+	int i;
+
+	for (i = 0; i < dc->num; i++) {
+		if (same_key(&dc->desc[i], key))
+			return &dc->desc[i];
+	}
+
+	return NULL;
+}
+
+static int add(desc_cache_t *dc, const desc_t *desc)
+{
+	desc_t *d = lookup(dc, desc);
+
+	if (!d) {
+		d = realloc(dc->desc, (dc->num + 1) * sizeof(desc_t));
+		if (!d) {
+			perror("realloc");
+			return 1;
+		}
+		dc->desc = d;
+		d = &dc->desc[dc->num++];
+	}
+
+	*d = *desc;
+
+	return 0;
+}
+
+/* read the module descriptors - a missing file is an empty cache */
+int desc_load(desc_cache_t *dc, const char *path)
+{
+	char line[128];
+	unsigned int v[12];
+	desc_t desc;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		if (errno == ENOENT)
+			return 0;
+		perror(path);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		memset(&desc, 0, sizeof(desc));
+
+		/*
+		 * ifname module_id hwid version status_hw status_flash hw_type
+		 * flash_type can_dlc [blksz]
+		 */
+		v[11] = 0;
+		if (sscanf(line, "%15s %u %u %2x%2x%2x%2x %u %u %u %u %u %u",
+			   desc.ifname, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5],
+			   &v[6], &v[7], &v[8], &v[9], &v[10], &v[11]) < 12)
+			continue; /* skip broken lines */
+
+		desc.module_id = v[0];
+		desc.hwid = v[1];
+		desc.version[0] = v[2];
+		desc.version[1] = v[3];
+		desc.version[2] = v[4];
+		desc.version[3] = v[5];
+		desc.status_hw = v[6];
+		desc.status_flash = v[7];
+		desc.hw_type = v[8];
+		desc.flash_type = v[9];
+		desc.can_dlc = v[10];
+		desc.blksz = v[11];
+
+		ret = add(dc, &desc);
+		if (ret)
+			break;
+	}
+
+	fclose(f);
+
+	return ret;
+}
+
+/* complete the descriptor with the cached content - returns 1 when not found */
+int desc_find(desc_cache_t *dc, desc_t *desc)
+{
+	desc_t *d;
+
+	pthread_mutex_lock(&dc->lock);
+
+	d = lookup(dc, desc);
+	if (d)
+		*desc = *d;
+
+	pthread_mutex_unlock(&dc->lock);
+
+	return (d == NULL);
+}
+
+int desc_store(desc_cache_t *dc, const desc_t *desc)
+{
+	int ret;
+
+	pthread_mutex_lock(&dc->lock);
+
+	ret = add(dc, desc);
+	if (!ret)
+		dc->dirty = 1;
+
+	pthread_mutex_unlock(&dc->lock);
+
+	return ret;
+}
+
+/* write the module descriptors when they have been changed */
+int desc_save(desc_cache_t *dc, const char *path)
+{
+	char tmp[264];
+	const desc_t *d;
+	FILE *f;
+	int i;
+
+	if (!dc->dirty)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return 1;
+	}
+
+	for (i = 0; i < dc->num; i++) {
+		d = &dc->desc[i];
+		fprintf(f, "%s %u %u %02X%02X%02X%02X %u %u %u %u %u %u\n",
+			d->ifname, d->module_id, d->hwid,
+			d->version[0], d->version[1], d->version[2], d->version[3],
+			d->status_hw, d->status_flash, d->hw_type, d->flash_type, d->can_dlc,
+			(unsigned int)d->blksz);
+	}
+
+	if (fclose(f) || rename(tmp, path)) {
+		perror(path);
+		unlink(tmp);
+		return 1;
+	}
+
+	dc->dirty = 0;
+
+	return 0;
+}
+
+void desc_free(desc_cache_t *dc)
+{
+	free(dc->desc);
+	pthread_mutex_destroy(&dc->lock);
+	memset(dc, 0, sizeof(*dc));
+}
+
+void prof_init(prof_cache_t *pc)
+{
+	memset(pc, 0, sizeof(*pc));
+	pthread_mutex_init(&pc->lock, NULL);
+}
+
+/* read the transfer profile - a missing file is an empty profile */
+int prof_load(prof_cache_t *pc, const char *path)
+{
+	char line[128];
+	unsigned int hw_type, blksz, tx_window, ftd_len;
+	unsigned int v[4];
+	uint8_t version[4];
+	FILE *f;
+	int i;
+
+	f = fopen(path, "r");
+	if (!f) {
+		if (errno == ENOENT)
+			return 0;
+		perror(path);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		/* bl hw_type version ftd_len */
+		if (!strncmp(line, "bl ", 3)) {
+			if ((sscanf(line + 3, "%u %2x%2x%2x%2x %u", &hw_type, &v[0], &v[1],
+				    &v[2], &v[3], &ftd_len) != 6) || (hw_type > 255))
+				continue; /* skip broken lines */
+
+			for (i = 0; i < 4; i++)
+				version[i] = v[i];
+
+			if (prof_store_bl(pc, hw_type, version, ftd_len)) {
+				fclose(f);
+				return 1;
+			}
+			continue;
+		}
+
+		/* hw_type blksz [tx_window ftd_len] */
+		tx_window = 0;
+		ftd_len = 0;
+		if ((sscanf(line, "%u %u %u %u", &hw_type, &blksz, &tx_window, &ftd_len) < 2) ||
+		    (hw_type > 255))
+			continue; /* skip broken lines */
+
+		pc->prof[hw_type].blksz = blksz;
+		pc->prof[hw_type].tx_window = tx_window;
+		pc->prof[hw_type].ftd_len = ftd_len;
+	}
+
+	fclose(f);
+	pc->dirty = 0;
+
+	return 0;
+}
+
+/* get the profile of a hardware type - returns 1 when nothing is known */
+int prof_find(prof_cache_t *pc, uint8_t hw_type, prof_t *prof)
+{
+	pthread_mutex_lock(&pc->lock);
+	*prof = pc->prof[hw_type];
+	pthread_mutex_unlock(&pc->lock);
+
+	return (prof->blksz == 0);
+}
+
+void prof_store(prof_cache_t *pc, uint8_t hw_type, const prof_t *prof)
+{
+	pthread_mutex_lock(&pc->lock);
+
+	if (memcmp(&pc->prof[hw_type], prof, sizeof(*prof))) {
+		pc->prof[hw_type] = *prof;
+		pc->dirty = 1;
+	}
+
+	pthread_mutex_unlock(&pc->lock);
+}
+
+static prof_bl_t *lookup_bl(prof_cache_t *pc, uint8_t hw_type, const uint8_t *version)
+{
+	int i;
+
+	for (i = 0; i < pc->num_bl; i++) {
+		if ((pc->bl[i].hw_type == hw_type) &&
+		    !memcmp(pc->bl[i].version, version, sizeof(pc->bl[i].version)))
+			return &pc->bl[i];
+	}
+
+	return NULL;
+}
+
+/* get the probed data len of a bootloader version - returns 1 when unknown */
+int prof_find_bl(prof_cache_t *pc, uint8_t hw_type, const uint8_t *version, uint8_t *ftd_len)
+{
+	prof_bl_t *b;
+
+	pthread_mutex_lock(&pc->lock);
+
+	b = lookup_bl(pc, hw_type, version);
+	if (b)
+		*ftd_len = b->ftd_len;
+
+	pthread_mutex_unlock(&pc->lock);
+
+	return (b == NULL);
+}
+
+int prof_store_bl(prof_cache_t *pc, uint8_t hw_type, const uint8_t *version, uint8_t ftd_len)
+{
+	prof_bl_t *b;
+	int ret = 0;
+
+	pthread_mutex_lock(&pc->lock);
+
+	b = lookup_bl(pc, hw_type, version);
+	if (!b) {
+		b = realloc(pc->bl, (pc->num_bl + 1) * sizeof(prof_bl_t));
+		if (!b) {
+			perror("realloc");
+			ret = 1;
+			goto out_unlock;
+		}
+		pc->bl = b;
+		b = &pc->bl[pc->num_bl++];
+		b->hw_type = hw_type;
+		memcpy(b->version, version, sizeof(b->version));
+		b->ftd_len = 0;
+	}
+
+	if (b->ftd_len != ftd_len) {
+		b->ftd_len = ftd_len;
+		pc->dirty = 1;
+	}
+
+out_unlock:
+	pthread_mutex_unlock(&pc->lock);
+
+	return ret;
+}
+
+/* write the transfer profile when it has been changed */
+int prof_save(prof_cache_t *pc, const char *path)
+{
+	char tmp[264];
+	FILE *f;
+	int i;
+
+	if (!pc->dirty)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return 1;
+	}
+
+	for (i = 0; i < 256; i++) {
+		if (pc->prof[i].blksz)
+			fprintf(f, "%d %u %u %u\n", i, (unsigned int)pc->prof[i].blksz,
+				(unsigned int)pc->prof[i].tx_window, pc->prof[i].ftd_len);
+	}
+
+	for (i = 0; i < pc->num_bl; i++)
+		fprintf(f, "bl %d %02X%02X%02X%02X %d\n", pc->bl[i].hw_type,
+			pc->bl[i].version[0], pc->bl[i].version[1], pc->bl[i].version[2],
+			pc->bl[i].version[3], pc->bl[i].ftd_len);
+
+	if (fclose(f) || rename(tmp, path)) {
+		perror(path);
+		unlink(tmp);
+		return 1;
+	}
+
+	pc->dirty = 0;
+
+	return 0;
+}
+
+void prof_free(prof_cache_t *pc)
+{
+	free(pc->bl);
+	pthread_mutex_destroy(&pc->lock);
+	memset(pc, 0, sizeof(*pc));
+}
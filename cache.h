@@ -0,0 +1,108 @@
+/*
+ * cache.h - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __CACHEH__
+#define __CACHEH__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <net/if.h>
+
+#include "image.h"
+
+/* module descriptor resolved by the query, the status and the JSON descriptor */
+typedef struct {
+	/* key */
+	char ifname[IFNAMSIZ];
+	uint8_t module_id;
+	uint8_t hwid; /* ppcan hw id */
+	uint8_t version[4]; /* bootloader date and version from the query reply */
+
+	/* hardware and flash type of the status reply to validate the entry */
+	uint8_t status_hw;
+	uint8_t status_flash;
+
+	uint8_t hw_type;
+	uint8_t flash_type;
+	uint8_t can_dlc; /* flash transfer data len - NO_DATA_LEN for the default */
+	uint32_t blksz; /* max. block size of the JSON descriptor - 0 for the default */
+} desc_t;
+
+typedef struct {
+	desc_t *desc;
+	int num;
+	int dirty;
+	pthread_mutex_t lock;
+} desc_cache_t;
+
+/* transfer profile - parameters which worked for a hardware type */
+typedef struct {
+	uint32_t blksz; /* largest verified block size - 0 when unknown */
+	uint32_t tx_window; /* max. frames in flight - 0 for the default */
+	uint8_t ftd_len; /* flash transfer data len - NO_DATA_LEN for the default */
+} prof_t;
+
+/* flash transfer data len probed for a bootloader version */
+typedef struct {
+	uint8_t hw_type;
+	uint8_t version[4]; /* bootloader date and version from the query reply */
+	uint8_t ftd_len;
+} prof_bl_t;
+
+typedef struct {
+	prof_t prof[256]; /* indexed by hw_type */
+	prof_bl_t *bl;
+	int num_bl;
+	int dirty;
+	pthread_mutex_t lock;
+} prof_cache_t;
+
+int cache_path(char *path, size_t len, const char *dir, const char *ifname,
+	       uint8_t module_id, uint8_t hw_type, uint8_t hwid);
+int cache_open(image_t *img, const char *dir, const char *ifname, uint8_t module_id,
+	       uint8_t hw_type, uint8_t hwid);
+int cache_store(const char *dir, const char *ifname, uint8_t module_id, uint8_t hw_type,
+		uint8_t hwid, const image_t *img);
+
+void desc_init(desc_cache_t *dc);
+int desc_load(desc_cache_t *dc, const char *path);
+int desc_find(desc_cache_t *dc, desc_t *desc);
+int desc_store(desc_cache_t *dc, const desc_t *desc);
+int desc_save(desc_cache_t *dc, const char *path);
+void desc_free(desc_cache_t *dc);
+
+void prof_init(prof_cache_t *pc);
+int prof_load(prof_cache_t *pc, const char *path);
+int prof_find(prof_cache_t *pc, uint8_t hw_type, prof_t *prof);
+void prof_store(prof_cache_t *pc, uint8_t hw_type, const prof_t *prof);
+int prof_find_bl(prof_cache_t *pc, uint8_t hw_type, const uint8_t *version, uint8_t *ftd_len);
+int prof_store_bl(prof_cache_t *pc, uint8_t hw_type, const uint8_t *version, uint8_t ftd_len);
+int prof_save(prof_cache_t *pc, const char *path);
+void prof_free(prof_cache_t *pc);
+
+#endif
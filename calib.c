@@ -0,0 +1,200 @@
+/*
+ * calib.c - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <linux/can.h>
+
+#include "pcanflash.h"
+#include "pcanfunc.h"
+#include "pcanhw.h"
+#include "flashplan.h"
+#include "engine.h"
+#include "cache.h"
+#include "calib.h"
+#include "rtt.h"
+
+#define CALIB_BLOCKS 3 /* test transfers per setting */
+
+/* result of the test transfers with one setting */
+typedef struct {
+	int failed; /* rejected blocks */
+	uint64_t rate; /* bytes/s */
+	rtt_t rtt; /* status round trip times */
+} calib_result_t;
+
+/* the largest flash sector takes the test blocks - returns its length */
+static uint32_t test_addr(uint8_t hw_type, uint32_t *addr)
+{
+	const hw_t *hwt = get_hw(hw_type);
+	uint32_t len = 0;
+	int i;
+
+	*addr = 0;
+	for (i = 0; i < hwt->num_flashblocks; i++) {
+		if (!hwt->flashblocks[i].skipped && (hwt->flashblocks[i].len > len)) {
+			*addr = hwt->flashblocks[i].start;
+			len = hwt->flashblocks[i].len;
+		}
+	}
+
+	return len;
+}
+
+/* transfer test blocks at addr without programming them */
+static int measure(engine_t *eng, uint8_t module_id, uint8_t hw_type, uint8_t ftd_len,
+		   uint32_t addr, const uint8_t *buf, uint32_t blksz, calib_result_t *res,
+		   const char *tag)
+{
+	uint64_t start, t;
+	int i, ret;
+
+	memset(res, 0, sizeof(*res));
+	start = rtt_now();
+
+	for (i = 0; i < CALIB_BLOCKS; i++) {
+		t = rtt_now();
+		if (get_status(eng, module_id, NULL) < 0)
+			return 1;
+		rtt_add(&res->rtt, rtt_now() - t);
+
+		ret = probe_block(eng, module_id, hw_type, ftd_len, addr, buf, blksz);
+		if (ret < 0)
+			return 1;
+		res->failed += ret;
+
+		/* an unanswered block already cost two status timeouts */
+		if (res->failed)
+			break;
+	}
+
+	t = rtt_now() - start;
+	res->rate = (uint64_t)blksz * CALIB_BLOCKS * 1000000 / (t ? t : 1);
+
+	printf("%s data len %2d block size %5u window %2u: %7llu bytes/s, status rtt p99 %u us, %d rejected\n",
+	       tag, ftd_len, blksz, eng->tx_window, (unsigned long long)res->rate,
+	       rtt_percentile(&res->rtt, RTT_PERCENTILE), res->failed);
+
+	return 0;
+}
+
+/*
+ * Find the transfer parameters of a module with dry-run block transfers
+ * (checksum without programming):
+ *
+ * - the tx window (frames in flight) starts at the netdev limit and is
+ *   halved until the blocks of the default size pass without rejections
+ * - 8 byte data frames are tried for hardware defaulting to 6 bytes
+ * - the block size is doubled as long as the blocks pass and the data
+ *   rate increases - up to the length of the sector with the test blocks
+ */
+int calibrate(engine_t *eng, uint8_t module_id, uint8_t hw_type, uint8_t ftd_len,
+	      prof_t *prof, const char *tag)
+{
+	calib_result_t res;
+	uint32_t blksz = get_max_blocksize(hw_type);
+	uint32_t addr, size, max;
+	uint64_t rate;
+	uint8_t *buf;
+	unsigned int window;
+	uint32_t seed = 0x2F6E2B1;
+	int i, ret = 1;
+
+	buf = malloc(PLAN_MAX_BLKSZ);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+
+	/* pseudo random test data */
+	for (i = 0; i < PLAN_MAX_BLKSZ; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	max = test_addr(hw_type, &addr);
+	if (max > PLAN_MAX_BLKSZ)
+		max = PLAN_MAX_BLKSZ;
+
+	/* the window of a previously calibrated module does not apply */
+	engine_tx_window_reset(eng);
+
+	printf("\n%scalibrating module id %d (hardware %d):\n", tag, module_id, hw_type);
+
+	while (1) {
+		if (measure(eng, module_id, hw_type, ftd_len, addr, buf, blksz, &res, tag))
+			goto out_free;
+
+		if (!res.failed)
+			break;
+
+		window = eng->tx_window;
+		if ((window <= 1) || (engine_tx_window(eng, window / 2) == window)) {
+			fprintf(stderr, "%smodule id %d rejects the default transfer!\n",
+				tag, module_id);
+			goto out_free;
+		}
+	}
+	rate = res.rate;
+
+	if (ftd_len == DATA_LEN6) {
+		if (measure(eng, module_id, hw_type, DATA_LEN8, addr, buf, blksz, &res, tag))
+			goto out_free;
+
+		if (!res.failed) {
+			ftd_len = DATA_LEN8;
+			rate = res.rate;
+		}
+	}
+
+	for (size = blksz * 2; size <= max; size *= 2) {
+		if (measure(eng, module_id, hw_type, ftd_len, addr, buf, size, &res, tag))
+			goto out_free;
+
+		if (res.failed || (res.rate <= rate))
+			break;
+
+		blksz = size;
+		rate = res.rate;
+	}
+
+	prof->blksz = blksz;
+	prof->tx_window = eng->tx_window;
+	prof->ftd_len = ftd_len;
+
+	printf("%s => data len %d block size %u window %u (%llu bytes/s)\n", tag,
+	       ftd_len, blksz, eng->tx_window, (unsigned long long)rate);
+
+	ret = 0;
+
+out_free:
+	free(buf);
+	return ret;
+}
@@ -27,6 +27,22 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC16_CLMUL
+#elif defined(__aarch64__) && defined(__GNUC__) && !defined(__clang__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC16_PMULL
+#endif
+
+#include "crc16.h"
+
+/* minimum length for the carry-less multiplication path */
+#define CRC16_FOLD_MIN 64
 
 const uint16_t crc16_table[256] = {
 	0x0000,0x1021,0x2042,0x3063,0x4084,0x50a5,0x60c6,0x70e7,
@@ -63,19 +79,251 @@ const uint16_t crc16_table[256] = {
 	0x6e17,0x7e36,0x4e55,0x5e74,0x2e93,0x3eb2,0x0ed1,0x1ef0
 };
 
-uint16_t calc_crc16(FILE *infile, uint32_t address, uint32_t len)
+/* crc16_slice[k][b] is the CRC of byte b followed by k zero bytes */
+static uint16_t crc16_slice[8][256];
+
+/* x^n mod P for folding 128 bit chunks over 128/256/384/512 bits */
+static uint64_t crc16_k[4][2];
+
+static uint16_t (*crc16_fold)(uint16_t crc, const uint8_t *data, size_t len);
+
+static uint16_t crc16_bytes(uint16_t crc, const uint8_t *data, size_t len)
+{
+	while (len--)
+		crc = (crc16_table[((crc >> 8) & 0xFF) ^ *data++] ^ (crc << 8)) & 0xFFFFU;
+
+	return crc;
+}
+
+static uint16_t crc16_slice8(uint16_t crc, const uint8_t *data, size_t len)
+{
+	while (len >= 8) {
+		crc = crc16_slice[7][data[0] ^ (crc >> 8)] ^
+		      crc16_slice[6][data[1] ^ (crc & 0xFF)] ^
+		      crc16_slice[5][data[2]] ^ crc16_slice[4][data[3]] ^
+		      crc16_slice[3][data[4]] ^ crc16_slice[2][data[5]] ^
+		      crc16_slice[1][data[6]] ^ crc16_slice[0][data[7]];
+		data += 8;
+		len -= 8;
+	}
+
+	return crc16_bytes(crc, data, len);
+}
+
+static uint64_t crc16_xpow(unsigned int n)
+{
+	uint32_t r = 1;
+
+	while (n--) {
+		r <<= 1;
+		if (r & 0x10000)
+			r ^= 0x11021; /* x^16 + x^12 + x^5 + 1 */
+	}
+
+	return r;
+}
+
+/*
+ * The carry-less multiplication paths fold the data in 128 bit chunks
+ * (most significant bit first) into a 128 bit value which is congruent
+ * to the data modulo P. The final 16 bytes are then reduced by the table
+ * driven code starting with a zero CRC which multiplies with x^16 mod P.
+ */
+
+#ifdef CRC16_CLMUL
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i crc16_load_x86(const uint8_t *data)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i crc16_fold_x86(__m128i x, const uint64_t *k)
+{
+	const __m128i kv = _mm_set_epi64x(k[0], k[1]);
+
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, kv, 0x11),
+			     _mm_clmulepi64_si128(x, kv, 0x00));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static uint16_t crc16_clmul(uint16_t crc, const uint8_t *data, size_t len)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i x0, x1, x2, x3;
+	uint8_t buf[16];
+
+	/* the current CRC value is added to the first two data bytes */
+	x0 = _mm_xor_si128(crc16_load_x86(data), _mm_set_epi64x((uint64_t)crc << 48, 0));
+	x1 = crc16_load_x86(data + 16);
+	x2 = crc16_load_x86(data + 32);
+	x3 = crc16_load_x86(data + 48);
+	data += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x0 = _mm_xor_si128(crc16_fold_x86(x0, crc16_k[3]), crc16_load_x86(data));
+		x1 = _mm_xor_si128(crc16_fold_x86(x1, crc16_k[3]), crc16_load_x86(data + 16));
+		x2 = _mm_xor_si128(crc16_fold_x86(x2, crc16_k[3]), crc16_load_x86(data + 32));
+		x3 = _mm_xor_si128(crc16_fold_x86(x3, crc16_k[3]), crc16_load_x86(data + 48));
+		data += 64;
+		len -= 64;
+	}
+
+	x0 = _mm_xor_si128(_mm_xor_si128(crc16_fold_x86(x0, crc16_k[2]),
+					 crc16_fold_x86(x1, crc16_k[1])),
+			   _mm_xor_si128(crc16_fold_x86(x2, crc16_k[0]), x3));
+
+	while (len >= 16) {
+		x0 = _mm_xor_si128(crc16_fold_x86(x0, crc16_k[0]), crc16_load_x86(data));
+		data += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *)buf, _mm_shuffle_epi8(x0, bswap));
+	crc = crc16_slice8(0, buf, sizeof(buf));
+
+	return crc16_slice8(crc, data, len);
+}
+
+static int crc16_have_clmul(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+#endif /* CRC16_CLMUL */
+
+#ifdef CRC16_PMULL
+
+__attribute__((target("+crypto")))
+static inline uint64x2_t crc16_load_arm(const uint8_t *data)
+{
+	uint8x16_t v = vrev64q_u8(vld1q_u8(data));
+
+	return vreinterpretq_u64_u8(vextq_u8(v, v, 8));
+}
+
+__attribute__((target("+crypto")))
+static inline uint64x2_t crc16_fold_arm(uint64x2_t x, const uint64_t *k)
+{
+	poly128_t h = vmull_p64(vgetq_lane_u64(x, 1), k[0]);
+	poly128_t l = vmull_p64(vgetq_lane_u64(x, 0), k[1]);
+
+	return veorq_u64(vreinterpretq_u64_p128(h), vreinterpretq_u64_p128(l));
+}
+
+__attribute__((target("+crypto")))
+static uint16_t crc16_pmull(uint16_t crc, const uint8_t *data, size_t len)
+{
+	uint64x2_t x0, x1, x2, x3;
+	uint8x16_t v;
+	uint8_t buf[16];
+
+	/* the current CRC value is added to the first two data bytes */
+	x0 = veorq_u64(crc16_load_arm(data), vcombine_u64(vcreate_u64(0),
+							  vcreate_u64((uint64_t)crc << 48)));
+	x1 = crc16_load_arm(data + 16);
+	x2 = crc16_load_arm(data + 32);
+	x3 = crc16_load_arm(data + 48);
+	data += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x0 = veorq_u64(crc16_fold_arm(x0, crc16_k[3]), crc16_load_arm(data));
+		x1 = veorq_u64(crc16_fold_arm(x1, crc16_k[3]), crc16_load_arm(data + 16));
+		x2 = veorq_u64(crc16_fold_arm(x2, crc16_k[3]), crc16_load_arm(data + 32));
+		x3 = veorq_u64(crc16_fold_arm(x3, crc16_k[3]), crc16_load_arm(data + 48));
+		data += 64;
+		len -= 64;
+	}
+
+	x0 = veorq_u64(veorq_u64(crc16_fold_arm(x0, crc16_k[2]),
+				 crc16_fold_arm(x1, crc16_k[1])),
+		       veorq_u64(crc16_fold_arm(x2, crc16_k[0]), x3));
+
+	while (len >= 16) {
+		x0 = veorq_u64(crc16_fold_arm(x0, crc16_k[0]), crc16_load_arm(data));
+		data += 16;
+		len -= 16;
+	}
+
+	/* back to memory byte order */
+	v = vrev64q_u8(vreinterpretq_u8_u64(x0));
+	vst1q_u8(buf, vextq_u8(v, v, 8));
+	crc = crc16_slice8(0, buf, sizeof(buf));
+
+	return crc16_slice8(crc, data, len);
+}
+
+static int crc16_have_pmull(void)
 {
-	uint16_t crc = 0xFFFFU;
-	uint8_t data;
+	return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+}
 
-	fseek(infile, address, SEEK_SET);
+#endif /* CRC16_PMULL */
 
-	while (len--) {
-		if (fread(&data, 1, 1, infile) != 1)
-			break;
+__attribute__((constructor))
+static void crc16_init(void)
+{
+	uint8_t test[256];
+	int i, k;
 
-		crc = (crc16_table[((crc >> 8) & 0xFF) ^ data] ^ (crc << 8)) & 0xFFFFU;
+	for (i = 0; i < 256; i++) {
+		crc16_slice[0][i] = crc16_table[i];
+		for (k = 1; k < 8; k++)
+			crc16_slice[k][i] = ((crc16_slice[k - 1][i] << 8) ^
+					     crc16_table[crc16_slice[k - 1][i] >> 8]) & 0xFFFFU;
 	}
 
-	return crc ^ 0xFFFFU;
+	/* x^(d+64) mod P and x^d mod P for folding over d bits */
+	for (k = 0; k < 4; k++) {
+		crc16_k[k][0] = crc16_xpow(128 * (k + 1) + 64);
+		crc16_k[k][1] = crc16_xpow(128 * (k + 1));
+	}
+
+#ifdef CRC16_CLMUL
+	if (crc16_have_clmul())
+		crc16_fold = crc16_clmul;
+#endif
+#ifdef CRC16_PMULL
+	if (crc16_have_pmull())
+		crc16_fold = crc16_pmull;
+#endif
+
+	/* only use the accelerated path when it is bit-exact */
+	if (crc16_fold) {
+		for (i = 0; i < sizeof(test); i++)
+			test[i] = i * 167 + 13;
+
+		for (i = CRC16_FOLD_MIN; i <= sizeof(test); i += 29) {
+			if (crc16_fold(0x1234, test, i) != crc16_bytes(0x1234, test, i)) {
+				crc16_fold = NULL;
+				break;
+			}
+		}
+	}
+}
+
+/* update a CRC16-CCITT register value (no initial or final XOR) */
+uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t len)
+{
+	if (crc16_fold && (len >= CRC16_FOLD_MIN))
+		return crc16_fold(crc, data, len);
+
+	return crc16_slice8(crc, data, len);
+}
+
+uint16_t calc_crc16(const image_t *img, uint32_t address, uint32_t len)
+{
+	/* the CRC only covers the content of the binary file */
+	len = image_avail(img, address, len);
+
+	return crc16_update(0xFFFFU, img->data + address, len) ^ 0xFFFFU;
 }
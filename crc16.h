@@ -28,11 +28,15 @@
 #ifndef __CRC16H__
 #define __CRC16H__
 
-#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "image.h"
 
 #define CRC_IDENT_STRING "CRC-Arrays"
 
-uint16_t calc_crc16(FILE *infile, uint32_t address, uint32_t len);
+uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t len);
+uint16_t calc_crc16(const image_t *img, uint32_t address, uint32_t len);
 
 #endif
 
@@ -0,0 +1,758 @@
+/*
+ * engine.c - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "pcanflash.h"
+#include "engine.h"
+#include "rtt.h"
+
+#define TX_RETRY_TIME 1 /* ms to wait when the netdev tx queue is full */
+#define ECHO_TIMEOUT 500 /* ms until missing echo frames are considered lost */
+#define MAX_EVENTS 4
+#define BATCH_LEN 32 /* CAN frames per sendmmsg() / recvmmsg() */
+
+static void deadline_in(struct timespec *ts, int ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static int ts_before(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+
+	return a->tv_nsec < b->tv_nsec;
+}
+
+/*
+ * The CAN frames are sent with echo flow control: Only tx_window frames are
+ * handed to the netdev until their echo (own message with MSG_CONFIRM) is
+ * received. This works with the default tx queue length of 10 frames and
+ * keeps the queue short so that status requests are not delayed behind a
+ * complete data block. The deadline of a request starts when its frame left
+ * the netdev as the frames queued before it (e.g. the data block of another
+ * module) take an unpredictable time on the bus.
+ */
+int engine_init(engine_t *eng, int s, int txqlen)
+{
+	struct epoll_event ev;
+	int flags;
+	int recv_own_msgs = 1;
+
+	memset(eng, 0, sizeof(*eng));
+	eng->s = s;
+	eng->epfd = -1;
+	eng->tfd = -1;
+
+	eng->txq = malloc(ENGINE_TXQ_LEN * sizeof(engine_tx_t));
+	if (!eng->txq) {
+		perror("malloc");
+		return 1;
+	}
+	eng->tx_size = ENGINE_TXQ_LEN;
+
+	eng->tx_window = ENGINE_TX_WINDOW;
+	if ((txqlen > 0) && (txqlen < ENGINE_TX_WINDOW))
+		eng->tx_window = txqlen;
+
+	/* without echo frames we can only rely on ENOBUFS */
+	if (setsockopt(s, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS,
+		       &recv_own_msgs, sizeof(recv_own_msgs)) < 0)
+		eng->tx_window = 0;
+
+	eng->tx_window_max = eng->tx_window;
+
+	flags = fcntl(s, F_GETFL);
+	if ((flags < 0) || (fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0)) {
+		perror("fcntl");
+		goto out_exit;
+	}
+
+	eng->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (eng->epfd < 0) {
+		perror("epoll_create1");
+		goto out_exit;
+	}
+
+	eng->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (eng->tfd < 0) {
+		perror("timerfd_create");
+		goto out_exit;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = s;
+	if (epoll_ctl(eng->epfd, EPOLL_CTL_ADD, s, &ev) < 0) {
+		perror("epoll_ctl");
+		goto out_exit;
+	}
+
+	ev.data.fd = eng->tfd;
+	if (epoll_ctl(eng->epfd, EPOLL_CTL_ADD, eng->tfd, &ev) < 0) {
+		perror("epoll_ctl");
+		goto out_exit;
+	}
+
+	return 0;
+
+out_exit:
+	engine_exit(eng);
+	return 1;
+}
+
+/* reduce the number of frames in flight - returns the resulting tx window */
+unsigned int engine_tx_window(engine_t *eng, unsigned int window)
+{
+	if (window && (window < eng->tx_window))
+		eng->tx_window = window;
+
+	return eng->tx_window;
+}
+
+/* undo the reductions of the tx window - returns the netdev limit */
+unsigned int engine_tx_window_reset(engine_t *eng)
+{
+	eng->tx_window = eng->tx_window_max;
+
+	return eng->tx_window;
+}
+
+void engine_exit(engine_t *eng)
+{
+	free(eng->txq);
+	eng->txq = NULL;
+
+	if (eng->tfd >= 0)
+		close(eng->tfd);
+
+	if (eng->epfd >= 0)
+		close(eng->epfd);
+
+	eng->tfd = -1;
+	eng->epfd = -1;
+}
+
+/* write queued frames until the socket or the netdev tx queue is full */
+static int tx_flush(engine_t *eng)
+{
+	struct mmsghdr msgs[BATCH_LEN];
+	struct iovec iov[BATCH_LEN];
+	struct epoll_event ev;
+	engine_tx_t *tx;
+	unsigned int num, i;
+	int pollout, blocked;
+	int ret;
+
+	eng->tx_retry = 0;
+	blocked = 0;
+
+	while (eng->tx_tail != eng->tx_head) {
+
+		num = eng->tx_head - eng->tx_tail;
+		if (num > BATCH_LEN)
+			num = BATCH_LEN;
+
+		/* wait for echo frames */
+		if (eng->tx_window) {
+			if (eng->tx_inflight >= eng->tx_window)
+				break;
+			if (num > eng->tx_window - eng->tx_inflight)
+				num = eng->tx_window - eng->tx_inflight;
+		}
+
+		memset(msgs, 0, sizeof(msgs[0]) * num);
+		for (i = 0; i < num; i++) {
+			tx = &eng->txq[(eng->tx_tail + i) & (eng->tx_size - 1)];
+			iov[i].iov_base = &tx->frame;
+			iov[i].iov_len = tx->mtu;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		/*
+		 * a partial send returns the number of sent frames - the error
+		 * of the first unsent frame is reported by the next call
+		 */
+		ret = sendmmsg(eng->s, msgs, num, 0);
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				blocked = 1;
+				break;
+			}
+
+			if (errno == EINTR)
+				continue;
+
+			/* no poll event when the netdev queue drains */
+			if (errno == ENOBUFS) {
+				eng->tx_retry = 1;
+				deadline_in(&eng->tx_retry_time, TX_RETRY_TIME);
+				break;
+			}
+
+			perror("sendmmsg");
+			return -1;
+		}
+
+		eng->tx_tail += ret;
+
+		if (eng->tx_window && ret) {
+			if (!eng->tx_inflight)
+				deadline_in(&eng->echo_time, ECHO_TIMEOUT);
+			eng->tx_inflight += ret;
+		} else
+			eng->tx_done = eng->tx_tail;
+	}
+
+	/* wait for EPOLLOUT only when the socket buffer is full */
+	pollout = blocked;
+	if (pollout != eng->tx_pollout) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | (pollout ? EPOLLOUT : 0);
+		ev.data.fd = eng->s;
+		if (epoll_ctl(eng->epfd, EPOLL_CTL_MOD, eng->s, &ev) < 0) {
+			perror("epoll_ctl");
+			return -1;
+		}
+		eng->tx_pollout = pollout;
+	}
+
+	return 0;
+}
+
+/* enable the reception and transmission of CAN FD frames */
+int engine_fd_frames(engine_t *eng)
+{
+	int enable_canfd = 1;
+
+	if (eng->fd_frames)
+		return 0;
+
+	if (setsockopt(eng->s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES,
+		       &enable_canfd, sizeof(enable_canfd)) < 0) {
+		perror("setsockopt CAN_RAW_FD_FRAMES");
+		return 1;
+	}
+
+	eng->fd_frames = 1;
+
+	return 0;
+}
+
+/* double the tx queue when a block has more frames than queued so far */
+static int tx_grow(engine_t *eng)
+{
+	engine_tx_t *txq;
+	unsigned int i;
+
+	if (eng->tx_size >= ENGINE_TXQ_MAX) {
+		fprintf(stderr, "engine tx queue overflow!\n");
+		return 1;
+	}
+
+	txq = malloc(2 * eng->tx_size * sizeof(engine_tx_t));
+	if (!txq) {
+		perror("malloc");
+		return 1;
+	}
+
+	/* keep the queue positions which are referenced by the requests */
+	for (i = eng->tx_tail; i != eng->tx_head; i++)
+		txq[i & (2 * eng->tx_size - 1)] = eng->txq[i & (eng->tx_size - 1)];
+
+	free(eng->txq);
+	eng->txq = txq;
+	eng->tx_size *= 2;
+
+	return 0;
+}
+
+static engine_tx_t *tx_slot(engine_t *eng)
+{
+	engine_tx_t *tx;
+
+	if (eng->error)
+		return NULL;
+
+	if ((eng->tx_head - eng->tx_tail == eng->tx_size) && tx_flush(eng))
+		return NULL;
+
+	if ((eng->tx_head - eng->tx_tail == eng->tx_size) && tx_grow(eng))
+		return NULL;
+
+	tx = &eng->txq[eng->tx_head & (eng->tx_size - 1)];
+	eng->tx_head++;
+
+	return tx;
+}
+
+/* queue a CAN frame - it is sent by engine_run() */
+int engine_send(engine_t *eng, const struct can_frame *cf)
+{
+	engine_tx_t *tx = tx_slot(eng);
+
+	if (!tx)
+		return -1;
+
+	memcpy(&tx->frame, cf, sizeof(*cf));
+	tx->mtu = CAN_MTU;
+
+	return 0;
+}
+
+/* queue a CAN FD frame - needs engine_fd_frames() */
+int engine_send_fd(engine_t *eng, const struct canfd_frame *cfd)
+{
+	engine_tx_t *tx;
+
+	if (!eng->fd_frames)
+		return -1;
+
+	tx = tx_slot(eng);
+	if (!tx)
+		return -1;
+
+	tx->frame = *cfd;
+	tx->mtu = CANFD_MTU;
+
+	return 0;
+}
+
+/* a request frame has to be queued right before starting its operation */
+static int op_start(engine_t *eng, engine_op_t *op, int kind, int request, int timeout,
+		    engine_done_t done, void *ctx)
+{
+	if (eng->error)
+		return -1;
+
+	if (op->kind != OP_NONE) {
+		fprintf(stderr, "engine operation already pending!\n");
+		return -1;
+	}
+
+	op->kind = kind;
+	op->timeout = timeout;
+	op->done = done;
+	op->ctx = ctx;
+	op->seq = eng->tx_head;
+	op->queued = request;
+	if (!request)
+		deadline_in(&op->deadline, timeout);
+	eng->pending++;
+
+	return 0;
+}
+
+/* the callback may start a new operation on the same slot */
+static void op_complete(engine_t *eng, engine_op_t *op, int err, const struct can_frame *cf)
+{
+	engine_done_t done = op->done;
+	void *ctx = op->ctx;
+
+	/* the reply may be processed before the echo of the request */
+	if (op->queued)
+		op->sent = rtt_now();
+
+	op->kind = OP_NONE;
+	eng->pending--;
+	done(ctx, err, cf);
+}
+
+static void init_request(struct can_frame *frame, uint8_t module_id, uint8_t cmd)
+{
+	memset(frame, 0, sizeof(*frame));
+	frame->can_id = CAN_ID;
+	frame->can_dlc = 7;
+	frame->data[0] = 0x7F;
+	frame->data[1] = 0xFF;
+	frame->data[2] = module_id;
+	frame->data[3] = cmd;
+}
+
+/* request the module status - done() gets the status reply */
+int engine_status(engine_t *eng, uint8_t module_id, int timeout,
+		  engine_done_t done, void *ctx)
+{
+	struct can_frame frame;
+
+	init_request(&frame, module_id, CAN2FLASH_STATE_REQUEST);
+
+	if (engine_send(eng, &frame))
+		return -1;
+
+	return op_start(eng, &eng->op[module_id & (ENGINE_IDS - 1)], OP_STATUS, 1,
+			timeout, done, ctx);
+}
+
+/* call done() after timeout ms */
+int engine_delay(engine_t *eng, uint8_t module_id, int timeout,
+		 engine_done_t done, void *ctx)
+{
+	return op_start(eng, &eng->op[module_id & (ENGINE_IDS - 1)], OP_DELAY, 0,
+			timeout, done, ctx);
+}
+
+/*
+ * Read the JSON descriptor frame by frame. The module sends a frame every
+ * gap us and timeout is the max. gap between the received frames.
+ */
+int engine_json(engine_t *eng, uint8_t module_id, unsigned int gap, int timeout,
+		engine_done_t done, void *ctx)
+{
+	struct can_frame frame;
+
+	init_request(&frame, module_id, CAN2FLASH_GET_JSON_DESCRIPTOR);
+	frame.data[4] = (gap >> 8) & 0xFF;
+	frame.data[5] = gap & 0xFF;
+
+	if (engine_send(eng, &frame))
+		return -1;
+
+	if (op_start(eng, &eng->bus, OP_JSON, 1, timeout, done, ctx))
+		return -1;
+
+	eng->bus.sn = 0;
+	eng->bus.err = ENGINE_OK;
+
+	return 0;
+}
+
+/* query all modules - completed when no reply arrived for quiet ms */
+int engine_query(engine_t *eng, int quiet, engine_done_t done, void *ctx)
+{
+	struct can_frame frame;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = CAN_ID;
+	frame.can_dlc = 3;
+	frame.data[0] = 0x80;
+	frame.data[1] = 0x00;
+	frame.data[2] = 0x06;
+
+	if (engine_send(eng, &frame))
+		return -1;
+
+	return op_start(eng, &eng->bus, OP_QUERY, 1, quiet, done, ctx);
+}
+
+/*
+ * Time in us when the last status request of the module left the netdev.
+ * Valid in the completion callback of the status request.
+ */
+uint64_t engine_sent(const engine_t *eng, uint8_t module_id)
+{
+	return eng->op[module_id & (ENGINE_IDS - 1)].sent;
+}
+
+/* complete the module query without waiting for the quiet bus */
+void engine_query_stop(engine_t *eng)
+{
+	if (eng->bus.kind == OP_QUERY)
+		op_complete(eng, &eng->bus, ENGINE_OK, NULL);
+}
+
+static void rx_json(engine_t *eng, const struct can_frame *cf)
+{
+	engine_op_t *op = &eng->bus;
+	uint8_t rxsn = cf->data[2];
+
+	if (rxsn == 0x00) {
+		/* start sequence */
+		op->sn = 0;
+		op->err = ENGINE_OK;
+	} else if ((rxsn == 0xFF) || (rxsn == op->sn + 1)) {
+		op->sn = rxsn;
+
+		/* rxsn sequence is .. 0xFD 0xFE 0x01 0x02 .. */
+		if (op->sn == 0xFE)
+			op->sn = 0;
+	} else {
+		/* lost frame - consume the remaining frames of this transfer */
+		op->err = ENGINE_EPROTO;
+	}
+
+	if (!op->err)
+		op->done(op->ctx, ENGINE_OK, cf);
+
+	if (rxsn == 0xFF)
+		op_complete(eng, op, op->err, NULL);
+	else
+		deadline_in(&op->deadline, op->timeout);
+}
+
+static void rx_frame(engine_t *eng, const struct can_frame *cf)
+{
+	engine_op_t *op;
+
+	/* status reply */
+	if ((cf->can_dlc == 6) && (cf->data[0] == 0x7F) && (cf->data[1] == 0xFF)) {
+		if (cf->data[2] >= ENGINE_IDS)
+			return;
+
+		op = &eng->op[cf->data[2]];
+		if (op->kind == OP_STATUS)
+			op_complete(eng, op, ENGINE_OK, cf);
+		return;
+	}
+
+	if (cf->can_dlc != 8)
+		return;
+
+	/* JSON descriptor */
+	if ((eng->bus.kind == OP_JSON) && (cf->data[0] == 0x7F) && (cf->data[1] == 0xFF)) {
+		rx_json(eng, cf);
+		return;
+	}
+
+	/* module query reply */
+	if ((eng->bus.kind == OP_QUERY) && ((cf->data[0] & 0xC0) == 0xC0) &&
+	    (cf->data[2] == 0x06)) {
+		deadline_in(&eng->bus.deadline, eng->bus.timeout);
+		eng->bus.done(eng->bus.ctx, ENGINE_OK, cf);
+	}
+}
+
+/* receive all pending frames - returns -1 on socket errors */
+static int rx_all(engine_t *eng)
+{
+	struct mmsghdr msgs[BATCH_LEN];
+	struct iovec iov[BATCH_LEN];
+	struct canfd_frame frames[BATCH_LEN];
+	int ret, i;
+
+	do {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < BATCH_LEN; i++) {
+			iov[i].iov_base = &frames[i];
+			iov[i].iov_len = sizeof(struct canfd_frame);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		ret = recvmmsg(eng->s, msgs, BATCH_LEN, MSG_DONTWAIT, NULL);
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return 0;
+			if (errno == EINTR)
+				continue;
+			perror("recvmmsg");
+			return -1;
+		}
+
+		for (i = 0; i < ret; i++) {
+			/* echo of our own frame => it left the netdev tx queue */
+			if (msgs[i].msg_hdr.msg_flags & MSG_CONFIRM) {
+				if (eng->tx_inflight) {
+					eng->tx_done++;
+					if (--eng->tx_inflight)
+						deadline_in(&eng->echo_time, ECHO_TIMEOUT);
+				}
+				continue;
+			}
+
+			/* the protocol replies are classic CAN frames */
+			if (msgs[i].msg_len == CAN_MTU)
+				rx_frame(eng, (struct can_frame *)&frames[i]);
+		}
+	} while (ret == BATCH_LEN);
+
+	return 0;
+}
+
+/* start the deadlines of the requests whose frame left the netdev */
+static void start_deadlines(engine_t *eng)
+{
+	engine_op_t *op;
+	int i;
+
+	for (i = 0; i <= ENGINE_IDS; i++) {
+		op = (i < ENGINE_IDS) ? &eng->op[i] : &eng->bus;
+
+		if ((op->kind == OP_NONE) || !op->queued || ((int)(eng->tx_done - op->seq) < 0))
+			continue;
+
+		op->queued = 0;
+		op->sent = rtt_now();
+		deadline_in(&op->deadline, op->timeout);
+	}
+}
+
+/* arm the timerfd for the nearest deadline */
+static int arm_timer(engine_t *eng)
+{
+	const struct timespec *next = NULL;
+	struct itimerspec its;
+	engine_op_t *op;
+	int i;
+
+	start_deadlines(eng);
+
+	for (i = 0; i <= ENGINE_IDS; i++) {
+		op = (i < ENGINE_IDS) ? &eng->op[i] : &eng->bus;
+
+		if ((op->kind != OP_NONE) && !op->queued &&
+		    (!next || ts_before(&op->deadline, next)))
+			next = &op->deadline;
+	}
+
+	if (eng->tx_retry && (!next || ts_before(&eng->tx_retry_time, next)))
+		next = &eng->tx_retry_time;
+
+	if (eng->tx_inflight && (!next || ts_before(&eng->echo_time, next)))
+		next = &eng->echo_time;
+
+	memset(&its, 0, sizeof(its));
+	if (next)
+		its.it_value = *next;
+
+	if (timerfd_settime(eng->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("timerfd_settime");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void expire_ops(engine_t *eng)
+{
+	struct timespec now;
+	engine_op_t *op;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* e.g. the frames got flushed from the netdev tx queue */
+	if (eng->tx_inflight && !ts_before(&now, &eng->echo_time)) {
+		eng->tx_inflight = 0;
+		eng->tx_done = eng->tx_tail;
+	}
+
+	start_deadlines(eng);
+
+	for (i = 0; i <= ENGINE_IDS; i++) {
+		op = (i < ENGINE_IDS) ? &eng->op[i] : &eng->bus;
+
+		if ((op->kind == OP_NONE) || op->queued || ts_before(&now, &op->deadline))
+			continue;
+
+		if ((op->kind == OP_STATUS) || (op->kind == OP_JSON))
+			op_complete(eng, op, ENGINE_TIMEOUT, NULL);
+		else
+			op_complete(eng, op, ENGINE_OK, NULL); /* delay elapsed or bus quiet */
+	}
+}
+
+/* complete all pending operations after a fatal socket error */
+static void fail_ops(engine_t *eng)
+{
+	int i;
+
+	eng->error = 1;
+	eng->tx_tail = eng->tx_head;
+	eng->tx_done = eng->tx_head;
+
+	for (i = 0; i < ENGINE_IDS; i++) {
+		if (eng->op[i].kind != OP_NONE)
+			op_complete(eng, &eng->op[i], ENGINE_EIO, NULL);
+	}
+
+	if (eng->bus.kind != OP_NONE)
+		op_complete(eng, &eng->bus, ENGINE_EIO, NULL);
+}
+
+/*
+ * Process CAN frames and deadlines until all operations are completed and
+ * all queued frames are sent. The completion callbacks may start new
+ * operations which keeps the engine running.
+ */
+int engine_run(engine_t *eng)
+{
+	struct epoll_event ev[MAX_EVENTS];
+	uint64_t expirations;
+	int rx, n, i;
+
+	if (eng->error)
+		return -1;
+
+	while (eng->pending || (eng->tx_tail != eng->tx_head)) {
+
+		if (tx_flush(eng) || arm_timer(eng))
+			goto out_fail;
+
+		n = epoll_wait(eng->epfd, ev, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			goto out_fail;
+		}
+
+		for (i = 0, rx = 0; i < n; i++) {
+			if (ev[i].data.fd == eng->tfd) {
+				if ((read(eng->tfd, &expirations, sizeof(expirations)) < 0) &&
+				    (errno != EAGAIN)) {
+					perror("read timerfd");
+					goto out_fail;
+				}
+			} else if (ev[i].events & (EPOLLIN | EPOLLERR))
+				rx = 1;
+		}
+
+		if (rx && rx_all(eng))
+			goto out_fail;
+
+		expire_ops(eng);
+	}
+
+	return 0;
+
+out_fail:
+	fail_ops(eng);
+	return -1;
+}
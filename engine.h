@@ -0,0 +1,134 @@
+/*
+ * engine.h - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __ENGINEH__
+#define __ENGINEH__
+
+#include <stdint.h>
+#include <time.h>
+#include <linux/can.h>
+
+#define ENGINE_IDS 64 /* module ids 0 .. 63 */
+#define ENGINE_TXQ_LEN 1024 /* initially queued CAN frames - power of two */
+#define ENGINE_TXQ_MAX 16384 /* a 64 KB block in 6 byte data frames fits */
+#define ENGINE_TX_WINDOW 16 /* max. own CAN frames in the netdev tx queue */
+#define STATUS_TIMEOUT 3000 /* ms to wait for a status reply after the request was sent */
+
+/* poll for the module status after switch, end and reset */
+#define POLL_MIN 50 /* ms */
+#define POLL_MAX 500 /* ms */
+#define SETTLE_TIMEOUT 4000 /* ms until the module has to be ready */
+
+/* completion codes */
+#define ENGINE_OK	 0
+#define ENGINE_TIMEOUT	-1
+#define ENGINE_EIO	-2
+#define ENGINE_EPROTO	-3
+
+/* operations waiting for a reply or a deadline */
+enum {
+	OP_NONE,
+	OP_STATUS,
+	OP_DELAY,
+	OP_JSON,
+	OP_QUERY
+};
+
+/*
+ * Completion callback of an operation. For OP_QUERY it is called for each
+ * module query reply and once with cf == NULL when the bus became quiet.
+ * For OP_JSON it is called for each descriptor frame in sequence and once
+ * with cf == NULL after the last frame.
+ */
+typedef void (*engine_done_t)(void *ctx, int err, const struct can_frame *cf);
+
+typedef struct {
+	int kind;
+	int timeout; /* ms */
+	struct timespec deadline;
+	unsigned int seq; /* tx queue position behind the request frame */
+	int queued; /* the deadline starts when the request frame left the netdev */
+	uint64_t sent; /* us when the request frame left the netdev */
+	engine_done_t done;
+	void *ctx;
+
+	/* JSON descriptor sequence */
+	uint8_t sn;
+	int err; /* reception error - reported at the end of the transfer */
+} engine_op_t;
+
+/* queued CAN frame - CAN_MTU or CANFD_MTU */
+typedef struct {
+	struct canfd_frame frame;
+	unsigned int mtu;
+} engine_tx_t;
+
+typedef struct {
+	int s; /* non-blocking CAN_RAW socket */
+	int epfd;
+	int tfd; /* timerfd for all deadlines */
+
+	engine_tx_t *txq; /* grows up to ENGINE_TXQ_MAX frames */
+	unsigned int tx_size;
+	unsigned int tx_head;
+	unsigned int tx_tail;
+	int tx_pollout; /* EPOLLOUT armed */
+	int tx_retry; /* tx queue of the netdev is full */
+	struct timespec tx_retry_time;
+	unsigned int tx_window; /* 0 => no echo flow control */
+	unsigned int tx_window_max; /* limit of the netdev */
+	unsigned int tx_inflight; /* sent frames without echo */
+	unsigned int tx_done; /* frames which left the netdev - tx queue position */
+	struct timespec echo_time;
+
+	engine_op_t op[ENGINE_IDS]; /* status and delay per module id */
+	engine_op_t bus; /* module query and JSON replies carry no module id */
+	int pending;
+	int error;
+	int fd_frames; /* CAN_RAW_FD_FRAMES enabled */
+	unsigned int json_gap; /* JSON frame gap in us the link sustained */
+} engine_t;
+
+int engine_init(engine_t *eng, int s, int txqlen);
+void engine_exit(engine_t *eng);
+unsigned int engine_tx_window(engine_t *eng, unsigned int window);
+unsigned int engine_tx_window_reset(engine_t *eng);
+int engine_fd_frames(engine_t *eng);
+int engine_send(engine_t *eng, const struct can_frame *cf);
+int engine_send_fd(engine_t *eng, const struct canfd_frame *cfd);
+int engine_status(engine_t *eng, uint8_t module_id, int timeout,
+		  engine_done_t done, void *ctx);
+int engine_delay(engine_t *eng, uint8_t module_id, int timeout,
+		 engine_done_t done, void *ctx);
+int engine_json(engine_t *eng, uint8_t module_id, unsigned int gap, int timeout,
+		engine_done_t done, void *ctx);
+int engine_query(engine_t *eng, int quiet, engine_done_t done, void *ctx);
+uint64_t engine_sent(const engine_t *eng, uint8_t module_id);
+void engine_query_stop(engine_t *eng);
+int engine_run(engine_t *eng);
+
+#endif
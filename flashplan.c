@@ -0,0 +1,416 @@
+/*
+ * flashplan.c - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "pcanhw.h"
+#include "pcanfunc.h"
+#include "flashplan.h"
+#include "blkscan.h"
+
+/* commands with a status request per sector erase and per block write */
+#define ERASE_CMDS 3
+#define WRITE_CMDS 6
+
+static int plan_erase(flashplan_t *plan, const image_t *img)
+{
+	const hw_t *hwt = get_hw(plan->hw_type);
+	const uint32_t flash_offset = get_flash_offset(plan->hw_type);
+	const fblock_t *fblock;
+	blkscan_t scan;
+	size_t len;
+	int i;
+
+	plan->erase = calloc(hwt->num_flashblocks, sizeof(plan_erase_t));
+	if (!plan->erase && hwt->num_flashblocks) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < hwt->num_flashblocks; i++) {
+		fblock = &hwt->flashblocks[i];
+
+		/* skip handling of this flash block? */
+		if (fblock->skipped)
+			continue;
+
+		/* check for wrong flash_offset configuration */
+		if (fblock->start < flash_offset) {
+			fprintf(stderr, "bad flashblock offset 0x%X for flashblock "
+				"start at 0x%X found for hardware type %d (%s)!\n",
+				flash_offset, fblock->start,
+				plan->hw_type, get_hw_name(plan->hw_type));
+			return 1;
+		}
+
+		/* empty block (all bytes are EMPTY / 0xFFU) -> no action */
+		len = image_avail(img, fblock->start - flash_offset, fblock->len);
+		scan_block(img->data + fblock->start - flash_offset, len, &scan);
+		if (scan.empty)
+			continue;
+
+		plan->erase[plan->num_erase].start = fblock->start;
+		plan->erase[plan->num_erase].len = fblock->len;
+		plan->erase[plan->num_erase].sectors = 1;
+		plan->num_erase++;
+	}
+
+	return 0;
+}
+
+static int plan_blocks(flashplan_t *plan, const image_t *img)
+{
+	const uint32_t blksz = plan->blksz;
+	const uint32_t crc_start = get_crc_startpos(plan->hw_type);
+	const uint32_t flash_offset = get_flash_offset(plan->hw_type);
+	plan_block_t *blk;
+	const uint8_t *data;
+	blkscan_t scan;
+	uint32_t foffset, fend;
+
+	plan->blocks = calloc(img->len / blksz + 1, sizeof(plan_block_t));
+	if (!plan->blocks) {
+		perror("calloc");
+		return 1;
+	}
+
+	/* only walk the blocks between the first and last non-EMPTY byte */
+	scan_block(img->data, img->len, &scan);
+	if (scan.empty)
+		return 0;
+
+	fend = scan.last + 1;
+
+	for (foffset = scan.first - scan.first % blksz; foffset < fend; foffset += blksz) {
+
+		data = image_span(img, foffset, blksz);
+
+		/* only non-empty blocks (not all bytes are EMPTY / 0xFFU) */
+		scan_block(data, blksz, &scan);
+		if (scan.empty)
+			continue;
+
+		/* check whether we need to patch the CRC array */
+		if ((crc_start) && (crc_start >= foffset) && (crc_start < foffset + blksz)) {
+			plan->crc_block = malloc(blksz);
+			if (!plan->crc_block) {
+				perror("malloc");
+				return 1;
+			}
+			memcpy(plan->crc_block, data, blksz);
+			write_crc_array(&plan->crc_block[crc_start - foffset],
+					foffset + blksz - crc_start, img, crc_start);
+			data = plan->crc_block;
+			scan_block(data, blksz, &scan);
+		}
+
+		blk = &plan->blocks[plan->num_blocks++];
+		blk->addr = foffset + flash_offset;
+		blk->foffset = foffset;
+		blk->data = data;
+		blk->csum = scan.csum;
+	}
+
+	return 0;
+}
+
+/* check whether the flash content of the range differs between both images */
+static int range_differs(const image_t *img, const image_t *base, size_t offset, size_t len)
+{
+	size_t a = image_avail(img, offset, len);
+	size_t b = image_avail(base, offset, len);
+	size_t n = (a < b) ? a : b;
+	blkscan_t scan;
+
+	if (memcmp(img->data + offset, base->data + offset, n))
+		return 1;
+
+	/* the shorter image is EMPTY behind its end */
+	if (a > n) {
+		scan_block(img->data + offset + n, a - n, &scan);
+		return !scan.empty;
+	}
+
+	if (b > n) {
+		scan_block(base->data + offset + n, b - n, &scan);
+		return !scan.empty;
+	}
+
+	return 0;
+}
+
+static int in_sector(const plan_erase_t *erase, uint32_t addr)
+{
+	return (addr >= erase->start) && (addr - erase->start < erase->len);
+}
+
+/*
+ * Reduce the plan to the sectors which differ from the base image (the
+ * known flash content). As erasing a sector wipes all its blocks, every
+ * non-empty block of a changed sector is written again. The sector with
+ * the CRC array is always written as the CRCs cover the whole image.
+ *
+ * The skipped blocks are collected in the plan unchanged (if not NULL)
+ * which erases nothing, to verify that the flash content really matches
+ * the base.
+ */
+int plan_diff(flashplan_t *plan, const image_t *img, const image_t *base,
+	      flashplan_t *unchanged)
+{
+	const uint32_t crc_start = get_crc_startpos(plan->hw_type);
+	const uint32_t flash_offset = get_flash_offset(plan->hw_type);
+	plan_erase_t *erase;
+	plan_block_t *blk;
+	int i, j, num, keep;
+
+	if (unchanged) {
+		memset(unchanged, 0, sizeof(*unchanged));
+		unchanged->hw_type = plan->hw_type;
+		unchanged->blksz = plan->blksz;
+		unchanged->blocks = calloc(plan->num_blocks + 1, sizeof(plan_block_t));
+		if (!unchanged->blocks) {
+			perror("calloc");
+			return 1;
+		}
+	}
+
+	for (i = 0, num = 0; i < plan->num_erase; i++) {
+		erase = &plan->erase[i];
+
+		keep = range_differs(img, base, erase->start - flash_offset, erase->len);
+		if (crc_start && plan->crc_block && in_sector(erase, crc_start + flash_offset))
+			keep = 1;
+
+		if (keep)
+			plan->erase[num++] = *erase;
+	}
+	plan->num_erase = num;
+
+	for (i = 0, num = 0; i < plan->num_blocks; i++) {
+		blk = &plan->blocks[i];
+
+		/* blocks outside of erased sectors are only written when changed */
+		keep = range_differs(img, base, blk->foffset, plan->blksz);
+		for (j = 0; j < plan->num_erase; j++) {
+			if (in_sector(&plan->erase[j], blk->addr)) {
+				keep = 1;
+				break;
+			}
+		}
+
+		if (keep)
+			plan->blocks[num++] = *blk;
+		else if (unchanged)
+			unchanged->blocks[unchanged->num_blocks++] = *blk;
+	}
+	plan->num_blocks = num;
+
+	return 0;
+}
+
+/* check that the erase range consists of contiguous non-skipped flash sectors */
+static int check_erase(const plan_erase_t *erase, const hw_t *hwt)
+{
+	const fblock_t *fblock;
+	uint32_t addr = erase->start;
+	int i, sectors = 0;
+
+	for (i = 0; i < hwt->num_flashblocks; i++) {
+		fblock = &hwt->flashblocks[i];
+
+		if (fblock->start != addr)
+			continue;
+
+		if (fblock->skipped)
+			return 1;
+
+		addr += fblock->len;
+		sectors++;
+
+		if (addr - erase->start >= erase->len)
+			break;
+	}
+
+	return (addr - erase->start != erase->len) || (sectors != erase->sectors);
+}
+
+/*
+ * Merge contiguous sectors into one erase range for bootloaders which
+ * accept multi-sector lengths. Sectors not to be erased (skipped, empty
+ * or unchanged) split the ranges.
+ */
+int plan_coalesce(flashplan_t *plan)
+{
+	const hw_t *hwt = get_hw(plan->hw_type);
+	plan_erase_t *cur = NULL, *erase;
+	int i, num;
+
+	for (i = 0, num = 0; i < plan->num_erase; i++) {
+		erase = &plan->erase[i];
+
+		if (cur && (cur->start + cur->len == erase->start)) {
+			cur->len += erase->len;
+			cur->sectors += erase->sectors;
+			continue;
+		}
+
+		cur = &plan->erase[num++];
+		*cur = *erase;
+	}
+	plan->num_erase = num;
+
+	for (i = 0; i < plan->num_erase; i++) {
+		if (check_erase(&plan->erase[i], hwt)) {
+			fprintf(stderr, "erase range 0x%X len 0x%X does not match the flash "
+				"layout of hardware type %d (%s)!\n",
+				plan->erase[i].start, plan->erase[i].len,
+				plan->hw_type, get_hw_name(plan->hw_type));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* check that the non-empty blocks of this size do not cross a flash sector boundary */
+static int blocks_fit(const image_t *img, uint8_t hw_type, uint32_t blksz)
+{
+	const hw_t *hwt = get_hw(hw_type);
+	const uint32_t flash_offset = get_flash_offset(hw_type);
+	const uint8_t *data;
+	blkscan_t scan;
+	uint32_t bound, foffset;
+	int i;
+
+	/* the start and the end of each sector */
+	for (i = 0; i < 2 * hwt->num_flashblocks; i++) {
+		bound = hwt->flashblocks[i / 2].start;
+		if (i & 1)
+			bound += hwt->flashblocks[i / 2].len;
+
+		if ((bound < flash_offset) || !((bound - flash_offset) % blksz))
+			continue;
+
+		/* the block which contains the sector boundary */
+		foffset = bound - flash_offset;
+		foffset -= foffset % blksz;
+
+		data = image_span(img, foffset, blksz);
+		if (!data)
+			continue;
+
+		scan_block(data, blksz, &scan);
+		if (!scan.empty)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Limit a negotiated block size to a power of two which keeps every
+ * written block inside one flash sector. Block sizes up to max_blocksize
+ * of the hardware type are always accepted.
+ */
+uint32_t plan_max_blksz(const image_t *img, uint8_t hw_type, uint32_t blksz)
+{
+	const uint32_t def = get_max_blocksize(hw_type);
+	uint32_t size = PLAN_MAX_BLKSZ;
+
+	while (size > blksz)
+		size /= 2;
+
+	while ((size > def) && !blocks_fit(img, hw_type, size))
+		size /= 2;
+
+	return size;
+}
+
+int plan_build(flashplan_t *plan, const image_t *img, uint8_t hw_type, uint32_t blksz)
+{
+	memset(plan, 0, sizeof(*plan));
+	plan->hw_type = hw_type;
+	plan->blksz = blksz;
+
+	if (!get_hw(hw_type) || !blksz) {
+		fprintf(stderr, "no flash plan for hardware type %d!\n", hw_type);
+		return 1;
+	}
+
+	if (plan_erase(plan, img) || plan_blocks(plan, img)) {
+		plan_free(plan);
+		return 1;
+	}
+
+	return 0;
+}
+
+void plan_free(flashplan_t *plan)
+{
+	free(plan->erase);
+	free(plan->blocks);
+	free(plan->crc_block);
+	memset(plan, 0, sizeof(*plan));
+}
+
+void plan_print(const flashplan_t *plan, uint8_t ftd_len)
+{
+	const uint32_t frames = (plan->blksz + ftd_len - 1) / ftd_len;
+	uint64_t bytes = (uint64_t)plan->num_blocks * plan->blksz;
+	uint64_t data_frames = (uint64_t)plan->num_blocks * frames;
+	uint64_t requests = (uint64_t)plan->num_blocks * WRITE_CMDS +
+		(uint64_t)plan->num_erase * ERASE_CMDS;
+	int i, first;
+
+	printf("\nflash plan for hardware type %d (%s) with block size %d:\n\n",
+	       plan->hw_type, get_hw_name(plan->hw_type), plan->blksz);
+
+	for (i = 0; i < plan->num_erase; i++)
+		printf(" erase 0x%06X len 0x%06X\n",
+		       plan->erase[i].start, plan->erase[i].len);
+
+	/* print contiguous runs of non-empty blocks */
+	for (i = 0, first = 0; i < plan->num_blocks; i++) {
+		if ((i + 1 < plan->num_blocks) &&
+		    (plan->blocks[i + 1].addr == plan->blocks[i].addr + plan->blksz))
+			continue;
+
+		printf(" write 0x%06X - 0x%06X (%d blocks)\n",
+		       plan->blocks[first].addr,
+		       plan->blocks[i].addr + plan->blksz - 1, i - first + 1);
+		first = i + 1;
+	}
+
+	printf("\n %d sectors to erase, %d blocks to write (%llu bytes)\n",
+	       plan->num_erase, plan->num_blocks, (unsigned long long)bytes);
+	printf(" %llu CAN frames (%llu data frames, %llu commands with status request)\n",
+	       (unsigned long long)(data_frames + 2 * requests),
+	       (unsigned long long)data_frames, (unsigned long long)requests);
+}
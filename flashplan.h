@@ -0,0 +1,69 @@
+/*
+ * flashplan.h - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __FLASHPLANH__
+#define __FLASHPLANH__
+
+#include <stdint.h>
+
+#include "image.h"
+
+/* largest block size - a block at the end of the image must fit into IMAGE_PAD */
+#define PLAN_MAX_BLKSZ IMAGE_PAD
+
+typedef struct {
+	uint32_t start; /* flash address */
+	uint32_t len;
+	int sectors; /* number of flash sectors of the hw_t flashblocks layout */
+} plan_erase_t;
+
+typedef struct {
+	uint32_t addr; /* flash address */
+	uint32_t foffset; /* offset in the bin-file */
+	uint16_t csum; /* additive checksum of the block */
+	const uint8_t *data; /* image span or patched CRC array block */
+} plan_block_t;
+
+typedef struct {
+	uint8_t hw_type;
+	uint32_t blksz;
+	int num_erase;
+	plan_erase_t *erase;
+	int num_blocks;
+	plan_block_t *blocks;
+	uint8_t *crc_block; /* copy of the block with the patched CRC array */
+} flashplan_t;
+
+int plan_build(flashplan_t *plan, const image_t *img, uint8_t hw_type, uint32_t blksz);
+int plan_diff(flashplan_t *plan, const image_t *img, const image_t *base,
+	      flashplan_t *unchanged);
+int plan_coalesce(flashplan_t *plan);
+void plan_free(flashplan_t *plan);
+uint32_t plan_max_blksz(const image_t *img, uint8_t hw_type, uint32_t blksz);
+void plan_print(const flashplan_t *plan, uint8_t ftd_len);
+
+#endif
@@ -35,6 +35,7 @@ const hw_t hwt4 = {"PCAN-Micromod", "PCAN_MicroMod",
 		   0xFF0000, /* flash offset */
 		   64, /* max blocksize */
 		   4, /* Flash ID type */
+		   0, /* erase timeout (ms), 0 = default */
 		   FLASH_BLOCK_ENTRIES(flashid4),
 		   flashid4};
 
@@ -44,6 +45,7 @@ const hw_t hwt16 = {"PCAN-Router", "PCAN-Router",
 		   0, /* flash offset */
 		   512, /* max blocksize */
 		   12, /* Flash ID type */
+		   0, /* erase timeout (ms), 0 = default */
 		   FLASH_BLOCK_ENTRIES(flashid12),
 		   flashid12};
 
@@ -53,6 +55,7 @@ const hw_t hwt19 = {"PCAN-MIO (32-bit)", "PCAN_MIOV4",
 		   0, /* flash offset */
 		   256, /* max blocksize */
 		   UNKNOWN_FLASH_ID, /* Flash ID type */
+		   0, /* erase timeout (ms), 0 = default */
 		   FLASH_BLOCK_ENTRIES(unknownflashid),
 		   unknownflashid};
 
@@ -62,6 +65,7 @@ const hw_t hwt21 = {"MU-Thermocouple1 CAN", "PCAN-MU",
 		   0, /* flash offset */
 		   512, /* max blocksize */
 		   UNKNOWN_FLASH_ID, /* Flash ID type */
+		   0, /* erase timeout (ms), 0 = default */
 		   FLASH_BLOCK_ENTRIES(unknownflashid),
 		   unknownflashid};
 
@@ -71,6 +75,7 @@ const hw_t hwt25 = {"PCAN-Router Pro", "PCAN-Router_Pro",
 		   0, /* flash offset */
 		   512, /* max blocksize */
 		   12, /* Flash ID type */
+		   0, /* erase timeout (ms), 0 = default */
 		   FLASH_BLOCK_ENTRIES(flashid12),
 		   flashid12};
 
@@ -80,6 +85,7 @@ const hw_t hwt31 = {"PCAN-RS-232", "PCAN-RS-232",
 		   0, /* flash offset */
 		   512, /* max blocksize */
 		   12, /* Flash ID type */
+		   0, /* erase timeout (ms), 0 = default */
 		   FLASH_BLOCK_ENTRIES(flashid12),
 		   flashid12};
 
@@ -89,6 +95,7 @@ const hw_t hwt35 = {"PCAN-Router DR", "PCAN-Router-DR",
 		   0, /* flash offset */
 		   512, /* max blocksize */
 		   12, /* Flash ID type */
+		   0, /* erase timeout (ms), 0 = default */
 		   FLASH_BLOCK_ENTRIES(flashid12),
 		   flashid12};
 
@@ -98,24 +105,27 @@ const hw_t hwt37 = {"PCAN-GPS", "PCAN-GPS",
 		   0, /* flash offset */
 		   512, /* max blocksize */
 		   UNKNOWN_FLASH_ID, /* Flash ID type */
+		   0, /* erase timeout (ms), 0 = default */
 		   FLASH_BLOCK_ENTRIES(unknownflashid),
 		   unknownflashid};
 
 const hw_t hwt40 = {"PCAN-Router FD", "PCAN-Router_FD",
-		   (FDATA_INVERT | DATA_MODE8 | END_PROGRAMMING),
+		   (FDATA_INVERT | DATA_MODE8 | END_PROGRAMMING | PIPELINE_BLOCKS),
 		   0, /* CRC start */
 		   0, /* flash offset */
 		   512, /* max blocksize */
 		   40, /* Flash ID type */
+		   10000, /* erase timeout (ms), 0 = default */
 		   FLASH_BLOCK_ENTRIES(flashid40),
 		   flashid40};
 
 const hw_t hwt42 = {"PCAN-Router Pro FD", "PCAN-Router_Pro_FD",
-		   (FDATA_INVERT | DATA_MODE8 | END_PROGRAMMING),
+		   (FDATA_INVERT | DATA_MODE8 | END_PROGRAMMING | PIPELINE_BLOCKS),
 		   0, /* CRC start */
 		   0, /* flash offset */
 		   512, /* max blocksize */
 		   42, /* Flash ID type */
+		   10000, /* erase timeout (ms), 0 = default */
 		   FLASH_BLOCK_ENTRIES(flashid42),
 		   flashid42};
 
@@ -125,6 +135,7 @@ const hw_t hwt43 = {"PCAN-MiniDiag FD", "PCAN-MiniDiag-FD",
 		   0, /* flash offset */
 		   256, /* max blocksize */
 		   UNKNOWN_FLASH_ID, /* Flash ID type */
+		   0, /* erase timeout (ms), 0 = default */
 		   FLASH_BLOCK_ENTRIES(unknownflashid),
 		   unknownflashid};
 
@@ -134,6 +145,7 @@ const hw_t hwt44 = {"PCAN-MicroMod FD", "PCAN-MicroMod-FD",
 		   0, /* flash offset */
 		   256, /* max blocksize */
 		   UNKNOWN_FLASH_ID, /* Flash ID type */
+		   0, /* erase timeout (ms), 0 = default */
 		   FLASH_BLOCK_ENTRIES(unknownflashid),
 		   unknownflashid};
 
@@ -0,0 +1,130 @@
+/*
+ * image.c - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "image.h"
+#include "pcanhw.h"
+
+int image_open(image_t *img, const char *path)
+{
+	struct stat st;
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	size_t filemap;
+	uint8_t *map;
+	int fd;
+
+	memset(img, 0, sizeof(*img));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("infile");
+		return 1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		return 1;
+	}
+
+	/* check the file length to fit into 16 MB */
+	if (st.st_size > IMAGE_MAX_LEN) {
+		printf("binary flash file too long!\n");
+		close(fd);
+		return 1;
+	}
+
+	img->len = st.st_size;
+	filemap = (img->len + pagesz - 1) & ~(pagesz - 1);
+	img->maplen = filemap + IMAGE_PAD;
+
+	/* reserve the whole area and place the file content at its start */
+	map = mmap(NULL, img->maplen, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return 1;
+	}
+
+	if (filemap && mmap(map, filemap, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		perror("mmap infile");
+		munmap(map, img->maplen);
+		close(fd);
+		return 1;
+	}
+
+	close(fd);
+
+	/* the tail of the last file page is zero filled by the kernel */
+	memset(map + img->len, EMPTY, img->maplen - img->len);
+	mprotect(map, img->maplen, PROT_READ);
+
+	img->data = map;
+	img->size = img->len + IMAGE_PAD;
+
+	return 0;
+}
+
+void image_close(image_t *img)
+{
+	if (img->data)
+		munmap((void *)img->data, img->maplen);
+
+	memset(img, 0, sizeof(*img));
+}
+
+/* get a read-only view - content behind the end of file reads as EMPTY */
+const uint8_t *image_span(const image_t *img, size_t offset, size_t len)
+{
+	if ((offset > img->size) || (len > img->size - offset))
+		return NULL;
+
+	return img->data + offset;
+}
+
+/* number of file content bytes inside the given range */
+size_t image_avail(const image_t *img, size_t offset, size_t len)
+{
+	if (offset >= img->len)
+		return 0;
+
+	if (len > img->len - offset)
+		return img->len - offset;
+
+	return len;
+}
@@ -0,0 +1,52 @@
+/*
+ * image.h - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __IMAGEH__
+#define __IMAGEH__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* max. size of a binary flash file (16 MB) */
+#define IMAGE_MAX_LEN 0x1000000
+
+/* EMPTY (0xFF) padding behind the end of the file content */
+#define IMAGE_PAD 0x10000
+
+typedef struct {
+	const uint8_t *data; /* file content followed by IMAGE_PAD EMPTY bytes */
+	size_t len; /* length of the file content */
+	size_t size; /* accessible length including the padding */
+	size_t maplen;
+} image_t;
+
+int image_open(image_t *img, const char *path);
+void image_close(image_t *img);
+const uint8_t *image_span(const image_t *img, size_t offset, size_t len);
+size_t image_avail(const image_t *img, size_t offset, size_t len);
+
+#endif
@@ -0,0 +1,389 @@
+/*
+ * json.c - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+
+/* parser states */
+enum {
+	JS_VALUE, /* expect a value */
+	JS_KEY_OR_END, /* behind '{' */
+	JS_VALUE_OR_END, /* behind '[' */
+	JS_KEY, /* behind ',' in an object */
+	JS_COLON,
+	JS_STRING,
+	JS_LITERAL, /* number, true, false or null */
+	JS_COMMA_OR_END,
+	JS_DONE,
+	JS_ERROR
+};
+
+void json_init(json_t *js)
+{
+	memset(js, 0, sizeof(*js));
+	js->state = JS_VALUE;
+}
+
+void json_free(json_t *js)
+{
+	int i;
+
+	for (i = 0; i < js->num; i++) {
+		free(js->pairs[i].path);
+		free(js->pairs[i].value);
+	}
+
+	free(js->pairs);
+	free(js->levels);
+	free(js->path);
+	free(js->tok);
+	json_init(js);
+}
+
+/* make room for len more bytes plus the trailing zero */
+static int grow(char **buf, size_t *size, size_t used, size_t len)
+{
+	size_t n = *size ? *size : 64;
+	char *p;
+
+	if (used + len < *size)
+		return 0;
+
+	while (used + len >= n)
+		n *= 2;
+
+	p = realloc(*buf, n);
+	if (!p)
+		return 1;
+
+	*buf = p;
+	*size = n;
+
+	return 0;
+}
+
+static int tok_add(json_t *js, char c)
+{
+	if (grow(&js->tok, &js->tok_size, js->tok_len, 1))
+		return 1;
+
+	js->tok[js->tok_len++] = c;
+	js->tok[js->tok_len] = 0;
+
+	return 0;
+}
+
+/* replace the path behind len with ".name" or "[index]" */
+static int set_path(json_t *js, size_t len, const char *name, int index)
+{
+	char idx[16];
+	size_t n;
+
+	if (name)
+		n = strlen(name) + 1;
+	else
+		n = snprintf(idx, sizeof(idx), "[%d]", index);
+
+	if (grow(&js->path, &js->path_size, len, n))
+		return 1;
+
+	if (!name)
+		memcpy(&js->path[len], idx, n + 1);
+	else if (len)
+		sprintf(&js->path[len], ".%s", name);
+	else
+		strcpy(js->path, name);
+
+	js->path_len = strlen(js->path);
+
+	return 0;
+}
+
+static int push(json_t *js, char type)
+{
+	json_level_t *lvl;
+
+	if (js->depth == js->levels_size) {
+		int n = js->levels_size ? js->levels_size * 2 : 8;
+
+		lvl = realloc(js->levels, n * sizeof(json_level_t));
+		if (!lvl)
+			return 1;
+
+		js->levels = lvl;
+		js->levels_size = n;
+	}
+
+	lvl = &js->levels[js->depth++];
+	lvl->path_len = js->path_len;
+	lvl->type = type;
+	lvl->index = 0;
+
+	return 0;
+}
+
+static int add_pair(json_t *js)
+{
+	json_pair_t *p;
+
+	if (js->num == js->pairs_size) {
+		int n = js->pairs_size ? js->pairs_size * 2 : 16;
+
+		p = realloc(js->pairs, n * sizeof(json_pair_t));
+		if (!p)
+			return 1;
+
+		js->pairs = p;
+		js->pairs_size = n;
+	}
+
+	p = &js->pairs[js->num];
+	p->path = strdup(js->path ? js->path : "");
+	p->value = strdup(js->tok ? js->tok : "");
+	if (!p->path || !p->value) {
+		free(p->path);
+		free(p->value);
+		return 1;
+	}
+
+	js->num++;
+
+	return 0;
+}
+
+/* a value, object or array is complete */
+static void end_value(json_t *js)
+{
+	if (js->depth)
+		js->state = JS_COMMA_OR_END;
+	else
+		js->state = JS_DONE;
+}
+
+static int pop(json_t *js, char type)
+{
+	if (!js->depth || (js->levels[js->depth - 1].type != type))
+		return 1;
+
+	js->depth--;
+	js->path_len = js->levels[js->depth].path_len;
+	if (js->path)
+		js->path[js->path_len] = 0;
+
+	end_value(js);
+
+	return 0;
+}
+
+/* start a value - objects and arrays open a new nesting level */
+static int begin_value(json_t *js, char c)
+{
+	js->tok_len = 0;
+	if (js->tok)
+		js->tok[0] = 0;
+
+	switch (c) {
+
+	case '{':
+		js->state = JS_KEY_OR_END;
+		return push(js, '{');
+
+	case '[':
+		js->state = JS_VALUE_OR_END;
+		if (push(js, '['))
+			return 1;
+		return set_path(js, js->path_len, NULL, 0);
+
+	case '"':
+		js->state = JS_STRING;
+		js->in_key = 0;
+		return 0;
+	}
+
+	js->state = JS_LITERAL;
+	return tok_add(js, c);
+}
+
+static int parse_char(json_t *js, char c)
+{
+	const int space = (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+	json_level_t *lvl = js->depth ? &js->levels[js->depth - 1] : NULL;
+
+	switch (js->state) {
+
+	case JS_STRING:
+		/* escaped characters are taken as they are */
+		if (js->escape) {
+			js->escape = 0;
+			return tok_add(js, c);
+		}
+
+		if (c == '\\') {
+			js->escape = 1;
+			return 0;
+		}
+
+		if (c != '"')
+			return tok_add(js, c);
+
+		if (js->in_key) {
+			js->state = JS_COLON;
+			return set_path(js, lvl->path_len, js->tok ? js->tok : "", 0);
+		}
+
+		end_value(js);
+		return add_pair(js);
+
+	case JS_LITERAL:
+		if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+		    (c >= 'A' && c <= 'Z') || (c == '.') || (c == '-') || (c == '+'))
+			return tok_add(js, c);
+
+		end_value(js);
+		if (add_pair(js))
+			return 1;
+
+		/* the delimiter belongs to the enclosing object or array */
+		return parse_char(js, c);
+	}
+
+	if (space)
+		return 0;
+
+	switch (js->state) {
+
+	case JS_DONE:
+		/* e.g. a stray byte in the last frame of the descriptor */
+		return 0;
+
+	case JS_VALUE:
+		return begin_value(js, c);
+
+	case JS_VALUE_OR_END:
+		if (c == ']')
+			return pop(js, '[');
+		return begin_value(js, c);
+
+	case JS_KEY_OR_END:
+		if (c == '}')
+			return pop(js, '{');
+		/* fallthrough */
+	case JS_KEY:
+		if (c != '"')
+			return 1;
+		js->state = JS_STRING;
+		js->in_key = 1;
+		js->tok_len = 0;
+		if (js->tok)
+			js->tok[0] = 0;
+		return 0;
+
+	case JS_COLON:
+		if (c != ':')
+			return 1;
+		js->state = JS_VALUE;
+		return 0;
+
+	case JS_COMMA_OR_END:
+		if (c == '}')
+			return pop(js, '{');
+		if (c == ']')
+			return pop(js, '[');
+		if (c != ',')
+			return 1;
+
+		if (lvl->type == '{') {
+			js->state = JS_KEY;
+			return 0;
+		}
+
+		js->state = JS_VALUE;
+		return set_path(js, lvl->path_len, NULL, ++lvl->index);
+	}
+
+	return 1; /* after an error */
+}
+
+/*
+ * Parse the next chunk of the descriptor. Zero bytes are padding behind
+ * the end of the descriptor and other content behind the top level value
+ * is ignored. Returns 1 on syntax or memory errors.
+ */
+int json_feed(json_t *js, const char *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (js->state == JS_ERROR)
+			return 1;
+
+		if (!data[i] && (js->state != JS_STRING))
+			continue;
+
+		if (parse_char(js, data[i])) {
+			js->state = JS_ERROR;
+			return 1;
+		}
+	}
+
+	return (js->state == JS_ERROR);
+}
+
+/* the top level value has been parsed completely */
+int json_complete(const json_t *js)
+{
+	return (js->state == JS_DONE);
+}
+
+/*
+ * Get the value of a path. When the path is missing the first value whose
+ * path ends with this key is taken as the module may nest the keys in an
+ * object.
+ */
+const char *json_get(const json_t *js, const char *path)
+{
+	const size_t len = strlen(path);
+	const char *p;
+	int i;
+
+	for (i = 0; i < js->num; i++) {
+		if (!strcmp(js->pairs[i].path, path))
+			return js->pairs[i].value;
+	}
+
+	for (i = 0; i < js->num; i++) {
+		p = js->pairs[i].path;
+		if ((strlen(p) > len) && !strcmp(p + strlen(p) - len, path) &&
+		    (p[strlen(p) - len - 1] == '.'))
+			return js->pairs[i].value;
+	}
+
+	return NULL;
+}
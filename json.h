@@ -0,0 +1,75 @@
+/*
+ * json.h - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __JSONH__
+#define __JSONH__
+
+#include <stddef.h>
+
+/* a value of the descriptor - nested keys are joined like "hardware.name" */
+typedef struct {
+	char *path;
+	char *value; /* strings without quotes, numbers and literals as text */
+} json_pair_t;
+
+/* nesting level of an object or array */
+typedef struct {
+	size_t path_len; /* path of the object or array itself */
+	char type; /* '{' or '[' */
+	int index; /* current array element */
+} json_level_t;
+
+/* incremental parser state - the input may be fed in chunks of any size */
+typedef struct {
+	int state;
+	int in_key;
+	int escape;
+
+	char *path;
+	size_t path_len;
+	size_t path_size;
+
+	char *tok; /* current string or literal */
+	size_t tok_len;
+	size_t tok_size;
+
+	json_level_t *levels;
+	int depth;
+	int levels_size;
+
+	json_pair_t *pairs;
+	int num;
+	int pairs_size;
+} json_t;
+
+void json_init(json_t *js);
+void json_free(json_t *js);
+int json_feed(json_t *js, const char *data, size_t len);
+int json_complete(const json_t *js);
+const char *json_get(const json_t *js, const char *path);
+
+#endif
@@ -32,8 +32,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <fnmatch.h>
+#include <pthread.h>
 
 #include <net/if.h>
+#include <net/if_arp.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
@@ -44,95 +47,549 @@
 #include "pcanflash.h"
 #include "pcanfunc.h"
 #include "pcanhw.h"
+#include "image.h"
+#include "flashplan.h"
+#include "engine.h"
+#include "session.h"
+#include "cache.h"
+#include "blkscan.h"
+#include "calib.h"
+#include "rtt.h"
+#include "trace.h"
 
-#define PCF_MIN_TX_QUEUE 500
-#define BUFSZ 512 /* max. known block size */
+#define MAX_BUSES 64
+#define QUIET_TIME 1000 /* ms without query replies to end the discovery */
 
 extern int optind, opterr, optopt;
 
-void print_usage(char *prg)
+typedef struct {
+	char ifname[IFNAMSIZ];
+	char tag[SESSION_TAG_LEN]; /* prefix for the output of this bus */
+	int txqlen; /* tx queue length of the netdev */
+	int mtu; /* CAN_MTU or CANFD_MTU */
+	pthread_t thread;
+	int modules; /* number of modules to be flashed */
+	int failed; /* number of failed modules */
+	int ret;
+	int index; /* bus index in the trace */
+} bus_t;
+
+/* command line options - shared by all CAN buses */
+static image_t img;
+static char *infile;
+static int query;
+static int do_reset;
+static int dry_run;
+static int pipeline;
+static int audit;
+static int multi_erase;
+static int quiet = QUIET_TIME;
+static int expected;
+static char *descfile; /* module descriptor cache */
+static int desc_refresh;
+static desc_cache_t descs;
+static int all_modules;
+static int have_ids;
+static uint8_t selected[MAX_MODULES];
+static int num_buses;
+static image_t base_img; /* known flash content for differential flashing */
+static char *basefile;
+static char *cachedir;
+static int check_unchanged; /* verify the blocks which a differential plan skips */
+static char *proffile; /* transfer profile */
+static int calib;
+static prof_cache_t profs;
+static char *sumfile; /* JSON summary of the phase timing */
+static char *tracefile; /* Chrome trace event file */
+static trace_t trace;
+static trace_t *tr; /* NULL when not tracing */
+
+/* flash plans are built once per hw_type and shared by all CAN buses */
+static flashplan_t plans[256];
+static pthread_mutex_t plans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int parse_module_ids(char *arg, uint8_t *selected)
 {
-	fprintf(stderr, "\nUsage: %s <options> <interface>\n\n", prg);
-	fprintf(stderr, "Options: -f <file.bin>  (binary file to flash)\n");
-	fprintf(stderr, "         -i <module_id> (skip question when discovering multiple ids)\n");
-	fprintf(stderr, "         -q             (just query modules and quit)\n");
-	fprintf(stderr, "         -r             (reset module after flashing)\n");
-	fprintf(stderr, "         -d             (dry run - skip erase/write commands)\n");
-	fprintf(stderr, "\n");
+	char *end;
+	unsigned long id;
+
+	do {
+		id = strtoul(arg, &end, 10);
+		if ((end == arg) || (id >= MAX_MODULES))
+			return 1;
+
+		selected[id] = 1;
+		arg = end + 1;
+	} while (*end == ',');
+
+	return (*end != 0);
 }
 
-int main(int argc, char **argv)
+/* glob patterns may also match other netdevs like lo or eth0 */
+static int is_can_if(int s, const char *ifname)
 {
-	static uint8_t buf[BUFSZ+2];
 	struct ifreq ifr;
-	struct sockaddr_can addr;
-	static struct can_frame modules[MAX_MODULES];
-	struct can_filter rfilter;
-	int s; /* CAN_RAW socket */
-	static FILE *infile;
-	static int query;
-	static int do_reset;
-	static int dry_run;
-	int module_id = NO_MODULE_ID;
-	int alternating_xor_flip;
-	uint32_t crc_start;
-	uint32_t floffset;
-	uint32_t blksz;
-	int opt, i;
-	uint8_t hw_type = 0;
-	long foffset;
-	int entries;
 
-	while ((opt = getopt(argc, argv, "f:i:qrd?")) != -1) {
-		switch (opt) {
-		case 'f':
-			infile = fopen(optarg, "r");
-			if (!infile) {
-				perror("infile");
-				return 1;
-			}
-			/* check the file length to fit into 16 MB */
-			fseek(infile, 0L, SEEK_END);
-			if (ftell(infile) > 0x1000000) {
-				printf("binary flash file too long!\n");
-				fclose(infile);
-				return 1;
-			}
-			rewind(infile);
-			break;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
 
-		case 'i':
-			module_id = strtoul(optarg, NULL, 10);
-			break;
+	if (ioctl(s, SIOCGIFHWADDR, &ifr) < 0)
+		return 0;
 
-		case 'q':
-			query = 1;
-			break;
+	return (ifr.ifr_hwaddr.sa_family == ARPHRD_CAN);
+}
 
-		case 'r':
-			do_reset = 1;
-			break;
+/* an interface given by several arguments is only flashed once */
+static int is_known_bus(const bus_t *buses, const char *ifname)
+{
+	int i;
 
-		case 'd':
-			dry_run = 1;
+	for (i = 0; i < num_buses; i++) {
+		if (!strncmp(buses[i].ifname, ifname, IFNAMSIZ))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* add an interface name or all interfaces matching a glob pattern */
+static int add_buses(const char *arg, bus_t *buses)
+{
+	struct if_nameindex *ifn, *i;
+	int found = 0;
+	int s;
+
+	s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (s < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	ifn = if_nameindex();
+	if (!ifn) {
+		perror("if_nameindex");
+		close(s);
+		return 1;
+	}
+
+	for (i = ifn; i->if_index; i++) {
+		if (fnmatch(arg, i->if_name, 0) || !is_can_if(s, i->if_name))
+			continue;
+
+		found++;
+		if (is_known_bus(buses, i->if_name))
+			continue;
+
+		if (num_buses == MAX_BUSES) {
+			fprintf(stderr, "too many interfaces!\n");
 			break;
+		}
 
-		case '?':
-		default:
-			print_usage(basename(argv[0]));
+		strncpy(buses[num_buses].ifname, i->if_name, IFNAMSIZ - 1);
+		buses[num_buses].index = num_buses;
+		num_buses++;
+	}
+
+	if_freenameindex(ifn);
+	close(s);
+
+	if (!found) {
+		fprintf(stderr, "no CAN interface found for '%s'!\n", arg);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int use_multi_erase(uint8_t hw_type)
+{
+	return multi_erase || has_hw_flags(hw_type, MULTI_SECTOR_ERASE);
+}
+
+static const flashplan_t *get_plan(uint8_t hw_type, uint32_t blksz, uint8_t ftd_len,
+				   flashplan_t *own)
+{
+	flashplan_t *plan = &plans[hw_type];
+
+	pthread_mutex_lock(&plans_lock);
+
+	/* a module with another negotiated block size gets its own plan */
+	if (plan->blksz && (plan->blksz != blksz))
+		plan = own;
+
+	/* prepare erase sectors, blocks and checksums once per hw_type */
+	if (!plan->blksz) {
+		if (plan_build(plan, &img, hw_type, blksz) ||
+		    (use_multi_erase(hw_type) && plan_coalesce(plan))) {
+			plan_free(plan);
+			plan = NULL;
+		} else if (dry_run)
+			plan_print(plan, ftd_len);
+	}
+
+	pthread_mutex_unlock(&plans_lock);
+
+	return plan;
+}
+
+/* ppcan hw id from the module query reply */
+static uint8_t ppcan_hw_id(const struct can_frame *cf)
+{
+	return ((cf->data[0] << 2) | (cf->data[1] >> 6)) & 0xFF;
+}
+
+/*
+ * Build a flash plan which only contains the sectors differing from the
+ * known flash content of the module (base file or cache). Returns 1 when
+ * the full plan has to be used as no known flash content is available.
+ */
+static int get_diff_plan(bus_t *bus, flashplan_t *plan, flashplan_t *unchanged,
+			 uint8_t module_id, uint8_t hw_type, uint32_t blksz, uint8_t ftd_len,
+			 uint8_t hwid)
+{
+	const image_t *base = &base_img;
+	image_t cached;
+	int sectors;
+	int ret;
+
+	if (!basefile) {
+		if (cache_open(&cached, cachedir, bus->ifname, module_id, hw_type, hwid)) {
+			printf("\n%sno cached flash content for module id %d - flashing the whole image\n",
+			       bus->tag, module_id);
 			return 1;
-			break;
 		}
+		base = &cached;
 	}
 
-	if ((argc - optind) != 1 || (infile && query) || (!(infile || query))) {
-		print_usage(basename(argv[0]));
+	if (plan_build(plan, &img, hw_type, blksz)) {
+		if (!basefile)
+			image_close(&cached);
+		return -1;
+	}
+
+	sectors = plan->num_erase;
+	ret = plan_diff(plan, &img, base, unchanged);
+
+	if (!basefile)
+		image_close(&cached);
+
+	if (ret) {
+		plan_free(plan);
+		if (unchanged)
+			plan_free(unchanged);
+		return -1;
+	}
+
+	printf("\n%sdifferential flashing: %d of %d sectors to be flashed\n",
+	       bus->tag, plan->num_erase, sectors);
+
+	if (use_multi_erase(hw_type) && plan_coalesce(plan)) {
+		plan_free(plan);
+		if (unchanged)
+			plan_free(unchanged);
+		return -1;
+	}
+
+	if (dry_run)
+		plan_print(plan, ftd_len);
+
+	return 0;
+}
+
+/*
+ * The known flash content of a differential plan may be wrong, e.g. when
+ * the module has been flashed by another tool. On request the blocks which
+ * the differential plans skip as unchanged are verified before flashing.
+ * A module whose flash content differs is flashed with the whole image and
+ * a module which fails the check is not flashed. The check leaves PPCAN
+ * mode modules in the bootloader.
+ */
+static int check_diff_plans(engine_t *eng, session_t *sessions, int num_sessions,
+			    flashplan_t *diff_plans, flashplan_t *check_plans)
+{
+	session_t checks[MAX_MODULES];
+	int idx[MAX_MODULES];
+	const flashplan_t *plan;
+	session_t *sess;
+	uint32_t blksz;
+	int num = 0;
+	int i, n;
+
+	for (i = 0; i < num_sessions; i++) {
+		if (!check_plans[i].num_blocks)
+			continue;
+
+		sess = &sessions[i];
+		session_init(&checks[num], sess->module_id, sess->hw_type, sess->ftd_len,
+			     &check_plans[i], dry_run, 0, pipeline, 1);
+		checks[num].check = 1;
+		checks[num].switched = sess->switched;
+		checks[num].trace = sess->trace;
+		checks[num].bus = sess->bus;
+		strcpy(checks[num].tag, sess->tag);
+		idx[num++] = i;
+	}
+
+	if (!num)
+		return 0;
+
+	run_sessions(eng, checks, num);
+
+	for (n = 0; n < num; n++) {
+		sess = &sessions[idx[n]];
+
+		if (checks[n].failed || (checks[n].step != STEP_DONE)) {
+			fprintf(stderr, "\n%scheck of the unchanged blocks failed!\n\n", sess->tag);
+			sess->failed = 1;
+			continue;
+		}
+
+		sess->switched = 1;
+		if (!checks[n].mismatch)
+			continue;
+
+		printf("\n%sflash content differs from the known content - flashing the whole image\n",
+		       sess->tag);
+
+		blksz = sess->plan->blksz;
+		plan_free(&diff_plans[idx[n]]);
+		plan = get_plan(sess->hw_type, blksz, sess->ftd_len, &diff_plans[idx[n]]);
+		if (!plan)
+			return 1;
+		sess->plan = plan;
+	}
+
+	return 0;
+}
+
+/*
+ * Evaluate a discovered module. With a module descriptor cache the status
+ * reply validates the cached descriptor and the JSON descriptor download
+ * is skipped. The status is requested once for both.
+ */
+static int eval_module(bus_t *bus, engine_t *eng, int module_id, struct can_frame *module,
+		       uint32_t *blksz)
+{
+	struct can_frame cf;
+	desc_t desc;
+	uint8_t status_hw, status_flash;
+
+	if (get_status(eng, module_id, &cf) < 0)
+		return 1;
+
+	if (!descfile)
+		return eval_modules(eng, module_id, module, &cf, blksz, bus->tag);
+
+	memset(&desc, 0, sizeof(desc));
+	memcpy(desc.ifname, bus->ifname, sizeof(desc.ifname));
+	desc.module_id = module_id;
+	desc.hwid = ppcan_hw_id(module);
+	memcpy(desc.version, &module->data[3], sizeof(desc.version));
+
+	/* the JSON descriptor overwrites the types in cf */
+	status_hw = cf.data[3];
+	status_flash = cf.data[4];
+
+	if (!desc_refresh && !desc_find(&descs, &desc) &&
+	    (desc.status_hw == status_hw) && (desc.status_flash == status_flash)) {
+		printf("%smodule id %02d (ppcan hw id %d) - cached descriptor\n",
+		       bus->tag, module_id, desc.hwid);
+		printf("%s - hardware %d (%s) flash type %d (%s)\n",
+		       bus->tag, desc.hw_type, get_hw_name(desc.hw_type),
+		       desc.flash_type, get_flash_name(desc.flash_type));
+		if (desc.can_dlc != NO_DATA_LEN)
+			printf("%s - flash transfer data len %d\n", bus->tag, desc.can_dlc);
+		if (desc.blksz)
+			printf("%s - max. block size %u\n", bus->tag, desc.blksz);
+
+		module->data[7] = desc.hw_type;
+		module->can_dlc = desc.can_dlc;
+		*blksz = desc.blksz;
 		return 0;
 	}
 
+	if (eval_modules(eng, module_id, module, &cf, blksz, bus->tag))
+		return 1;
+
+	desc.status_hw = status_hw;
+	desc.status_flash = status_flash;
+	desc.hw_type = module->data[7];
+	desc.flash_type = get_hw(desc.hw_type)->flash_id_type;
+	desc.can_dlc = module->can_dlc;
+	desc.blksz = *blksz;
+
+	return desc_store(&descs, &desc);
+}
+
+/* switch a PPCAN mode module into the bootloader once for the probes */
+static int enter_bootloader(bus_t *bus, engine_t *eng, uint8_t module_id, uint8_t hw_type,
+			    int *switched)
+{
+	uint64_t start = rtt_now();
+
+	if (*switched || !has_hw_flags(hw_type, SWITCH_TO_BOOTLOADER))
+		return 0;
+
+	if (switch_to_bootloader(eng, module_id) || (poll_status(eng, module_id, NULL) < 0))
+		return 1;
+
+	trace_add(tr, bus->index, module_id, TRACE_SWITCH, start, 0, 0);
+	*switched = 1;
+
+	return 0;
+}
+
+/*
+ * Hardware without DATA_MODE8 defaults to 6 byte data frames with the
+ * 0x7F 0xFF header. Check whether the bootloader accepts a block in
+ * headerless 8 byte data frames without programming it. The result is
+ * remembered per bootloader version in the transfer profile.
+ */
+static uint8_t probe_data_len(bus_t *bus, engine_t *eng, uint8_t module_id, uint8_t hw_type,
+			      const struct can_frame *module, int *switched)
+{
+	const uint32_t blksz = get_max_blocksize(hw_type);
+	uint8_t ftd_len;
+	uint32_t foffset;
+	blkscan_t scan;
+	uint64_t start;
+	int ret;
+
+	if (!prof_find_bl(&profs, hw_type, &module->data[3], &ftd_len))
+		return ftd_len;
+
+	scan_block(img.data, img.len, &scan);
+	if (scan.empty || enter_bootloader(bus, eng, module_id, hw_type, switched))
+		return DATA_LEN6;
+
+	foffset = scan.first - scan.first % blksz;
+	start = rtt_now();
+	ret = probe_block(eng, module_id, hw_type, DATA_LEN8,
+			  foffset + get_flash_offset(hw_type),
+			  image_span(&img, foffset, blksz), blksz);
+	trace_add(tr, bus->index, module_id, TRACE_PROBE, start,
+		  foffset + get_flash_offset(hw_type), blksz);
+	if (ret < 0)
+		return DATA_LEN6;
+
+	ftd_len = ret ? DATA_LEN6 : DATA_LEN8;
+	printf("\n%sbootloader of module id %d %s 8 byte data frames\n",
+	       bus->tag, module_id, ret ? "rejects" : "accepts");
+
+	prof_store_bl(&profs, hw_type, &module->data[3], ftd_len);
+
+	return ftd_len;
+}
+
+/*
+ * Find the largest block size the bootloader accepts by transferring
+ * blocks of the image without programming them. PPCAN mode modules are
+ * switched into the bootloader for the probe.
+ */
+static uint32_t probe_blksz(bus_t *bus, engine_t *eng, uint8_t module_id, uint8_t hw_type,
+			    uint8_t ftd_len, int *switched)
+{
+	const uint32_t flash_offset = get_flash_offset(hw_type);
+	const uint32_t max = plan_max_blksz(&img, hw_type, PLAN_MAX_BLKSZ);
+	uint32_t blksz = get_max_blocksize(hw_type);
+	uint32_t size, foffset;
+	int ret;
+	blkscan_t scan;
+	uint64_t start;
+
+	scan_block(img.data, img.len, &scan);
+	if ((max <= blksz) || scan.empty)
+		return blksz;
+
+	if (enter_bootloader(bus, eng, module_id, hw_type, switched))
+		return blksz;
+
+	printf("\n%sprobing block sizes of module id %d:", bus->tag, module_id);
+
+	for (size = blksz * 2; size <= max; size *= 2) {
+		foffset = scan.first - scan.first % size;
+		start = rtt_now();
+		ret = probe_block(eng, module_id, hw_type, ftd_len, foffset + flash_offset,
+				  image_span(&img, foffset, size), size);
+		trace_add(tr, bus->index, module_id, TRACE_PROBE, start, foffset + flash_offset,
+			  size);
+		if (ret)
+			break;
+
+		printf(" %u", size);
+		blksz = size;
+	}
+
+	printf(" => %u\n", blksz);
+
+	return blksz;
+}
+
+/*
+ * Calibrate the transfer parameters of a module with dry-run block
+ * transfers and store them in the transfer profile. PPCAN mode modules
+ * are switched into the bootloader and reset afterwards.
+ */
+static int calibrate_module(bus_t *bus, engine_t *eng, uint8_t module_id, uint8_t hw_type,
+			    uint8_t ftd_len)
+{
+	prof_t prof;
+	int switched = 0;
+	uint64_t start;
+	int ret;
+
+	if (enter_bootloader(bus, eng, module_id, hw_type, &switched))
+		return 1;
+
+	start = rtt_now();
+	prof_find(&profs, hw_type, &prof);
+	ret = calibrate(eng, module_id, hw_type, ftd_len, &prof, bus->tag);
+	if (!ret)
+		prof_store(&profs, hw_type, &prof);
+	trace_add(tr, bus->index, module_id, TRACE_CALIB, start, 0, 0);
+
+	start = rtt_now();
+	if (switched && (reset_module(eng, module_id) || engine_run(eng)))
+		return 1;
+	if (switched)
+		trace_add(tr, bus->index, module_id, TRACE_RESET, start, 0, 0);
+
+	return ret;
+}
+
+/*
+ * Negotiate the block size of a module: the max. block size from the JSON
+ * descriptor, the block size which worked before for this hardware type
+ * or - with a transfer profile - the largest block size the bootloader
+ * accepts. Defaults to max_blocksize of the hardware type.
+ */
+static uint32_t get_blksz(bus_t *bus, engine_t *eng, uint8_t module_id, uint8_t hw_type,
+			  uint8_t ftd_len, uint32_t json_blksz, int *switched)
+{
+	prof_t prof;
+
+	if (json_blksz)
+		return plan_max_blksz(&img, hw_type, json_blksz);
+
+	if (!prof_find(&profs, hw_type, &prof))
+		return plan_max_blksz(&img, hw_type, prof.blksz);
+
+	if (proffile && !audit)
+		return probe_blksz(bus, eng, module_id, hw_type, ftd_len, switched);
+
+	return get_max_blocksize(hw_type);
+}
+
+static int open_bus(bus_t *bus)
+{
+	struct ifreq ifr;
+	struct sockaddr_can addr;
+	struct can_filter rfilter;
+	int s; /* CAN_RAW socket */
+
 	if ((s = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
 		perror("socket");
-		return 1;
+		return -1;
 	}
 
 	/* set single CAN ID raw filters for RX and TX frames */
@@ -142,55 +599,110 @@ int main(int argc, char **argv)
 	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, &rfilter, sizeof(rfilter));
 
 	/* copy netdev name for ioctl request */
-	strncpy(ifr.ifr_name, argv[optind], sizeof(ifr.ifr_name)-1);
+	memset(&ifr, 0, sizeof(ifr));
+	memcpy(ifr.ifr_name, bus->ifname, sizeof(ifr.ifr_name));
 
-	/* check tx queue length ... */
-	if (ioctl(s, SIOCGIFTXQLEN, &ifr) < 0) {
-		perror("SIOCGIFTXQLEN");
-		return 1;
-	}
+	/* the tx queue length limits the number of frames in flight */
+	if (ioctl(s, SIOCGIFTXQLEN, &ifr) < 0)
+		bus->txqlen = 0;
+	else
+		bus->txqlen = ifr.ifr_qlen;
 
-	/* ... to be at least PCF_MIN_TX_QUEUE CAN frames */
-	if (ifr.ifr_qlen < PCF_MIN_TX_QUEUE) {
-		fprintf(stderr, "tx queue len %d is too small! Must be at least %d.\n",
-			ifr.ifr_qlen, PCF_MIN_TX_QUEUE);
-		return 1;
-	}
+	/* CAN FD data frames need a CAN FD capable interface */
+	if (ioctl(s, SIOCGIFMTU, &ifr) < 0)
+		bus->mtu = CAN_MTU;
+	else
+		bus->mtu = ifr.ifr_mtu;
 
 	/* get interface index for bind() */
 	if (ioctl(s, SIOCGIFINDEX, &ifr) < 0) {
 		perror("SIOCGIFINDEX");
-		return 1;
+		goto out_close;
 	}
 	addr.can_ifindex = ifr.ifr_ifindex;
 	addr.can_family = AF_CAN;
 
 	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 		perror("bind");
-		return 1;
+		goto out_close;
 	}
 
-	entries = query_modules(s, modules);
-	if (!entries) {
-		fprintf(stderr, "module query failed!\n");
+	return s;
+
+out_close:
+	close(s);
+	return -1;
+}
+
+/* discover the modules on one CAN bus and flash the selected ones */
+static int flash_bus(bus_t *bus)
+{
+	struct can_frame modules[MAX_MODULES];
+	session_t sessions[MAX_MODULES];
+	flashplan_t diff_plans[MAX_MODULES];
+	flashplan_t check_plans[MAX_MODULES]; /* blocks skipped by the diff_plans */
+	uint8_t flash_ids[MAX_MODULES];
+	uint32_t max_blksz[MAX_MODULES]; /* from the JSON descriptor */
+	engine_t eng;
+	prof_t prof;
+	const flashplan_t *plan;
+	int module_id = NO_MODULE_ID;
+	int num_sessions = 0;
+	uint32_t blksz;
+	uint8_t hw_type;
+	uint64_t start;
+	int entries;
+	int diff;
+	int switched;
+	int probe_dlc;
+	int ret = 1;
+	int s, i;
+
+	s = open_bus(bus);
+	if (s < 0)
 		return 1;
+
+	if (engine_init(&eng, s, bus->txqlen)) {
+		close(s);
+		return 1;
+	}
+
+	memset(modules, 0, sizeof(modules));
+	memset(diff_plans, 0, sizeof(diff_plans));
+	memset(check_plans, 0, sizeof(check_plans));
+	memset(max_blksz, 0, sizeof(max_blksz));
+	memcpy(flash_ids, selected, sizeof(flash_ids));
+
+	start = rtt_now();
+	entries = query_modules(&eng, modules, quiet, expected, have_ids ? selected : NULL);
+	trace_add(tr, bus->index, NO_MODULE_ID, TRACE_DISCOVERY, start, 0, 0);
+	if (entries <= 0) {
+		fprintf(stderr, "%smodule query failed!\n", bus->tag);
+		goto out_close;
 	}
 
 	/* print module list */
-	printf("\nfound modules:\n\n");
+	printf("\n%sfound modules:\n\n", bus->tag);
 	for (i = 0; i < MAX_MODULES; i++) {
 		if (modules[i].can_id) {
-			if (eval_modules(s, i, &modules[i]))
-				return 1;
+			start = rtt_now();
+			if (eval_module(bus, &eng, i, &modules[i], &max_blksz[i]))
+				goto out_close;
+			trace_add(tr, bus->index, i, TRACE_DESCRIPTOR, start, 0, 0);
 		}
 	}
 
 	if (query) {
 		printf("\n");
-		return 0;
+		ret = 0;
+		goto out_close;
 	}
 
-	if (module_id == NO_MODULE_ID) {
+	/* an audit covers all modules of the bus by default */
+	if (all_modules || (audit && !have_ids)) {
+		for (i = 0; i < MAX_MODULES; i++)
+			flash_ids[i] = (modules[i].can_id != 0);
+	} else if (!have_ids) {
 		if (entries == 1) {
 			/* catch first and only module */
 			for (i = 0; i < MAX_MODULES; i++) {
@@ -199,139 +711,437 @@ int main(int argc, char **argv)
 					break;
 				}
 			}
+		} else if (num_buses > 1) {
+			fprintf(stderr, "%smultiple modules found - please provide module ids!\n",
+				bus->tag);
+			goto out_close;
 		} else {
 			printf("\nmultiple modules found - please provide module id : ");
 			scanf("%d", &module_id);
 			module_id &= MAX_MODULES_MASK;
 		}
+		flash_ids[module_id] = 1;
 	}
 
-	if (!(modules[module_id].can_id)) {
-		fprintf(stderr, "\nmodule id not found in module list!\n\n");
-		exit(1);
-	}
+	for (module_id = 0; module_id < MAX_MODULES; module_id++) {
+
+		if (!flash_ids[module_id])
+			continue;
+
+		if (!(modules[module_id].can_id)) {
+			fprintf(stderr, "\n%smodule id %d not found in module list!\n\n",
+				bus->tag, module_id);
+			goto out_close;
+		}
 
-	/* restore hw_type of this module_id index from data[7] */
-	hw_type = modules[module_id].data[7];
+		/* restore hw_type of this module_id index from data[7] */
+		hw_type = modules[module_id].data[7];
+
+		if (get_hw(hw_type) == NULL) {
+			fprintf(stderr, "\n%sno flash configuration available for hardware type %d!\n\n",
+				bus->tag, hw_type);
+			goto out_close;
+		}
+
+		/* transfer parameters calibrated for this hardware type */
+		if (calib || prof_find(&profs, hw_type, &prof))
+			memset(&prof, 0, sizeof(prof));
+
+		/* take default values when not provided by JSON config */
+		probe_dlc = 0;
+		if (modules[module_id].can_dlc == NO_DATA_LEN) {
+			if (prof.ftd_len)
+				modules[module_id].can_dlc = prof.ftd_len;
+			else if (has_hw_flags(hw_type, DATA_MODE64))
+				modules[module_id].can_dlc = DATA_LEN64;
+			else if (has_hw_flags(hw_type, DATA_MODE8))
+				modules[module_id].can_dlc = DATA_LEN8;
+			else {
+				/* probed like the block size - see get_blksz() */
+				modules[module_id].can_dlc = DATA_LEN6;
+				probe_dlc = proffile && !audit;
+			}
+		}
 
-	if (get_hw(hw_type) == NULL) {
-		fprintf(stderr, "\nno flash configuration available for hardware type %d!\n\n",
-			hw_type);
-		exit(1);
+		if (modules[module_id].can_dlc == DATA_LEN64) {
+			if (bus->mtu != CANFD_MTU) {
+				printf("\n%s%s is no CAN FD interface - using classic CAN data frames\n",
+				       bus->tag, bus->ifname);
+				if (has_hw_flags(hw_type, DATA_MODE8))
+					modules[module_id].can_dlc = DATA_LEN8;
+				else
+					modules[module_id].can_dlc = DATA_LEN6;
+			} else if (engine_fd_frames(&eng))
+				goto out_close;
+		}
+
+		if (!get_num_flashblocks(hw_type)) {
+			fprintf(stderr, "%sno flashblocks found for hardware type %d (%s)!\n",
+				bus->tag, hw_type, get_hw_name(hw_type));
+			goto out_close;
+		}
+
+		if (calib) {
+			if (calibrate_module(bus, &eng, module_id, hw_type,
+					     modules[module_id].can_dlc))
+				goto out_close;
+			continue;
+		}
+
+		if (check_ch_name(&img, hw_type)) {
+			fprintf(stderr, "\n%sno ch_filename in bin-file for hardware type %d (%s)!\n\n",
+				bus->tag, hw_type, get_hw_name(hw_type));
+			goto out_close;
+		}
+
+		switched = 0;
+		if (probe_dlc)
+			modules[module_id].can_dlc = probe_data_len(bus, &eng, module_id, hw_type,
+								    &modules[module_id],
+								    &switched);
+
+		engine_tx_window(&eng, prof.tx_window);
+
+		blksz = get_blksz(bus, &eng, module_id, hw_type, modules[module_id].can_dlc,
+				  max_blksz[module_id], &switched);
+		if ((blksz > PLAN_MAX_BLKSZ) || (blksz < 32)) {
+			fprintf(stderr, "\n%sblock size %d out of range!\n\n", bus->tag, blksz);
+			goto out_close;
+		}
+
+		/* differential flashing falls back to the full plan */
+		diff = 1;
+		if (!audit && (basefile || cachedir)) {
+			diff = get_diff_plan(bus, &diff_plans[num_sessions],
+					     check_unchanged ? &check_plans[num_sessions] : NULL,
+					     module_id, hw_type, blksz,
+					     modules[module_id].can_dlc,
+					     ppcan_hw_id(&modules[module_id]));
+			if (diff < 0)
+				goto out_close;
+		}
+
+		if (diff)
+			plan = get_plan(hw_type, blksz, modules[module_id].can_dlc,
+					&diff_plans[num_sessions]);
+		else
+			plan = &diff_plans[num_sessions];
+		if (!plan)
+			goto out_close;
+
+		printf("\n%s%s module id %d with flash transfer data len %d and block size %d\n",
+		       bus->tag, audit ? "auditing" : "flashing", module_id,
+		       modules[module_id].can_dlc, blksz);
+
+		session_init(&sessions[num_sessions], module_id, hw_type,
+			     modules[module_id].can_dlc, plan, dry_run, do_reset, pipeline,
+			     audit);
+		sessions[num_sessions].switched = switched;
+		sessions[num_sessions].trace = tr;
+		sessions[num_sessions].bus = bus->index;
+		num_sessions++;
 	}
 
-	if (check_ch_name(infile, hw_type)) {
-		fprintf(stderr, "\nno ch_filename in bin-file for hardware type %d (%s)!\n\n",
-			hw_type, get_hw_name(hw_type));
-		exit(1);
+	if (calib) {
+		ret = 0;
+		goto out_close;
 	}
 
-	/* take default values when not provided by JSON config */
-	if (modules[module_id].can_dlc == NO_DATA_LEN) {
-		if (has_hw_flags(hw_type, DATA_MODE8))
-			modules[module_id].can_dlc = DATA_LEN8;
+	/* prefix the output with the module id when flashing concurrently */
+	for (i = 0; i < num_sessions; i++) {
+		if (num_sessions > 1 && num_buses > 1)
+			snprintf(sessions[i].tag, SESSION_TAG_LEN, "[%.*s:%d] ",
+				 IFNAMSIZ - 1, bus->ifname, sessions[i].module_id);
+		else if (num_sessions > 1)
+			snprintf(sessions[i].tag, SESSION_TAG_LEN, "[%d] ",
+				 sessions[i].module_id);
 		else
-			modules[module_id].can_dlc = DATA_LEN6;
+			strcpy(sessions[i].tag, bus->tag);
 	}
 
-	blksz = get_max_blocksize(hw_type);
-	if ((blksz > BUFSZ) || (blksz < 32)) {
-		fprintf(stderr, "\nmax_blocksize %d out of range!\n\n", blksz);
-		exit(1);
+	if (check_diff_plans(&eng, sessions, num_sessions, diff_plans, check_plans))
+		goto out_close;
+
+	bus->modules = num_sessions;
+	bus->failed = run_sessions(&eng, sessions, num_sessions);
+
+	/* remember the flash content of the successfully flashed or verified modules */
+	for (i = 0; cachedir && !dry_run && i < num_sessions; i++) {
+		if (sessions[i].step != STEP_DONE || sessions[i].failed ||
+		    sessions[i].mismatch)
+			continue;
+
+		if (cache_store(cachedir, bus->ifname, sessions[i].module_id, sessions[i].hw_type,
+				ppcan_hw_id(&modules[sessions[i].module_id]), &img))
+			fprintf(stderr, "%sunable to cache the flash content of module id %d!\n",
+				sessions[i].tag, sessions[i].module_id);
 	}
 
-	printf("\nflashing module id %d with flash transfer data len %d and block size %d\n",
-	       module_id, modules[module_id].can_dlc, blksz);
+	/* remember the largest block size which worked for this hardware type */
+	for (i = 0; proffile && !dry_run && i < num_sessions; i++) {
+		if (sessions[i].step != STEP_DONE || sessions[i].failed)
+			continue;
+
+		prof_find(&profs, sessions[i].hw_type, &prof);
+		if (sessions[i].plan->blksz > prof.blksz) {
+			prof.blksz = sessions[i].plan->blksz;
+			prof_store(&profs, sessions[i].hw_type, &prof);
+		}
+	}
 
-	if (has_hw_flags(hw_type, SWITCH_TO_BOOTLOADER)) { /* PPCAN mode modules */
-		printf("\nswitch module into bootloader ... ");
-		fflush(stdout);
-		switch_to_bootloader(s, module_id);
-		sleep(1);
-		get_status(s, module_id, NULL);
-		printf("done\n");
+	if (bus->failed) {
+		fprintf(stderr, "\n%s%s failed for %d of %d module(s)!\n\n",
+			bus->tag, audit ? "audit" : "flashing", bus->failed, num_sessions);
+		goto out_close;
 	}
 
-	printf("\nerasing flash sectors:\n");
+	ret = 0;
 
-	entries = get_num_flashblocks(hw_type);
-	if (!(entries)) {
-		fprintf(stderr, "no flashblocks found for hardware type %d (%s)!\n",
-			hw_type, get_hw_name(hw_type));
-		exit(1);
+out_close:
+	for (i = 0; i < MAX_MODULES; i++) {
+		plan_free(&diff_plans[i]);
+		plan_free(&check_plans[i]);
 	}
-	for (i = 0; i < entries; i++)
-		erase_flashblocks(s, dry_run, infile, module_id, hw_type, i);
+	engine_exit(&eng);
+	close(s);
+	return ret;
+}
+
+static void *bus_thread(void *arg)
+{
+	bus_t *bus = arg;
+
+	bus->ret = flash_bus(bus);
+
+	return NULL;
+}
+
+void print_usage(char *prg)
+{
+	fprintf(stderr, "\nUsage: %s <options> <interface> [<interface> ...]\n\n", prg);
+	fprintf(stderr, "Options: -f <file.bin>  (binary file to flash)\n");
+	fprintf(stderr, "         -i <module_id> (skip question when discovering multiple ids)\n");
+	fprintf(stderr, "                        (comma separated list flashes these modules concurrently)\n");
+	fprintf(stderr, "                        (the discovery ends as soon as these modules replied)\n");
+	fprintf(stderr, "         -a             (flash all discovered modules concurrently)\n");
+	fprintf(stderr, "         -q             (just query modules and quit)\n");
+	fprintf(stderr, "         -r             (reset module after flashing)\n");
+	fprintf(stderr, "         -d             (dry run - skip erase/write commands)\n");
+	fprintf(stderr, "         -p             (pipelined block transfer when supported by the hardware)\n");
+	fprintf(stderr, "         -v             (verify only - audit the flash content of all modules\n");
+	fprintf(stderr, "                        against the image without erasing or programming)\n");
+	fprintf(stderr, "         -n <count>     (end the discovery when count modules replied)\n");
+	fprintf(stderr, "         -w <ms>        (end the discovery after ms without replies - default %d)\n",
+		QUIET_TIME);
+	fprintf(stderr, "         -m <modfile>   (cache the module descriptors to skip the JSON download)\n");
+	fprintf(stderr, "         -M             (refresh the cached module descriptors)\n");
+	fprintf(stderr, "         -e             (erase contiguous sectors with one command - needs a\n");
+	fprintf(stderr, "                        bootloader which accepts multi-sector lengths)\n");
+	fprintf(stderr, "         -b <base.bin>  (known flash content - only flash the changed sectors)\n");
+	fprintf(stderr, "         -c <cachedir>  (remember the flash content of each module in cachedir\n");
+	fprintf(stderr, "                        and only flash the changed sectors the next time)\n");
+	fprintf(stderr, "         -k             (check the sectors skipped by -b/-c against the module\n");
+	fprintf(stderr, "                        before flashing - transfers the whole image)\n");
+	fprintf(stderr, "         -t <profile>   (transfer profile - probe the largest block size and the\n");
+	fprintf(stderr, "                        data len the bootloader accepts and remember them)\n");
+	fprintf(stderr, "         -C             (calibrate block size, tx window and data len of the\n");
+	fprintf(stderr, "                        modules with dry-run transfers and write the profile)\n");
+	fprintf(stderr, "         -s <file.json> (write a JSON summary of the phase timing - '-' for stdout)\n");
+	fprintf(stderr, "         -T <file.json> (write the phases as Chrome trace events)\n");
+	fprintf(stderr, "\nMultiple interfaces (or glob patterns like 'can*') are processed in parallel.\n");
+	fprintf(stderr, "\n");
+}
 
-	printf("\nwriting flash blocks:\n");
-	foffset = 0;
-	alternating_xor_flip = has_hw_flags(hw_type, FDATA_INVERT);
-	crc_start = get_crc_startpos(hw_type);
-	floffset = get_flash_offset(hw_type);
+int main(int argc, char **argv)
+{
+	static bus_t buses[MAX_BUSES];
+	int opt, i;
+	int ret = 0;
 
-	while (1) {
+	while ((opt = getopt(argc, argv, "f:i:aqrdpveb:c:kn:w:m:Mt:Cs:T:?")) != -1) {
+		switch (opt) {
+		case 'f':
+			infile = optarg;
+			break;
 
-		if (fseek(infile, foffset, SEEK_SET))
+		case 'i':
+			if (parse_module_ids(optarg, selected)) {
+				fprintf(stderr, "invalid module id list '%s'!\n", optarg);
+				return 1;
+			}
+			have_ids = 1;
 			break;
 
-		memset(&buf, 0xFF, blksz);
-		fread(buf, 1, blksz, infile);
+		case 'a':
+			all_modules = 1;
+			break;
 
-		for (i = 0; i < blksz; i++) {
-			if (buf[i] != EMPTY)
-				break;
-		}
+		case 'q':
+			query = 1;
+			break;
 
-		/* non-empty block (not all bytes are EMPTY / 0xFFU) */
-		if (i != blksz) {
+		case 'r':
+			do_reset = 1;
+			break;
 
-			/* check whether we need to patch the CRC array */
-			if ((crc_start) && (crc_start >= foffset) && (crc_start < foffset + blksz))
-				write_crc_array(&buf[crc_start - foffset], infile, crc_start);
+		case 'd':
+			dry_run = 1;
+			break;
 
-			/* write non-empty block */
-			write_block(s, dry_run, module_id, foffset + floffset, blksz,
-				    buf, alternating_xor_flip, modules[module_id].can_dlc);
-		}
+		case 'p':
+			pipeline = 1;
+			break;
+
+		case 'v':
+			audit = 1;
+			break;
+
+		case 'e':
+			multi_erase = 1;
+			break;
+
+		case 'b':
+			basefile = optarg;
+			break;
+
+		case 'c':
+			cachedir = optarg;
+			break;
+
+		case 'k':
+			check_unchanged = 1;
+			break;
+
+		case 'm':
+			descfile = optarg;
+			break;
+
+		case 'M':
+			desc_refresh = 1;
+			break;
+
+		case 't':
+			proffile = optarg;
+			break;
+
+		case 'C':
+			calib = 1;
+			break;
 
-		if (feof(infile))
+		case 's':
+			sumfile = optarg;
 			break;
 
-		foffset += blksz;
+		case 'T':
+			tracefile = optarg;
+			break;
+
+		case 'n':
+			expected = atoi(optarg);
+			break;
 
-	} /* while (1) */
+		case 'w':
+			quiet = atoi(optarg);
+			if (quiet <= 0) {
+				fprintf(stderr, "invalid quiet time '%s'!\n", optarg);
+				return 1;
+			}
+			break;
 
-	if (has_hw_flags(hw_type, END_PROGRAMMING)) { /* recent hw modules */
-		printf("\nend programming ... ");
-		fflush(stdout);
-		end_programming(s, module_id);
-		sleep(1);
-		get_status(s, module_id, NULL);
-		printf("done\n");
+		case '?':
+		default:
+			print_usage(basename(argv[0]));
+			return 1;
+			break;
+		}
 	}
 
-	if (has_hw_flags(hw_type, RESET_AFTER_FLASH) || do_reset) {
-		printf("\nreset module ... ");
-		fflush(stdout);
-		reset_module(s, module_id);
-		sleep(1);
+	if ((argc - optind) < 1 || ((infile != NULL) + query + calib != 1)) {
+		print_usage(basename(argv[0]));
+		return 0;
+	}
 
-		/* a reset which is issued by a command line option
-		 * likely leads into starting the application which
-		 * does not know about this status message. Therefore
-		 * only get the status when this is used in an original
-		 * PCAN flashing process, e.g. the PCAN Router Pro
-		 */
-		if (has_hw_flags(hw_type, RESET_AFTER_FLASH))
-			get_status(s, module_id, NULL);
+	if (calib && !proffile) {
+		fprintf(stderr, "calibration needs a transfer profile (-t)!\n");
+		return 1;
+	}
 
-		printf("done\n");
+	for (i = optind; i < argc; i++) {
+		if (add_buses(argv[i], buses))
+			return 1;
 	}
 
-	printf("\ndone.\n\n");
+	if (sumfile || tracefile) {
+		trace_init(&trace);
+		tr = &trace;
+		for (i = 0; i < num_buses; i++)
+			trace_bus(tr, i, buses[i].ifname);
+	}
 
-	close(s);
-	fclose(infile);
+	desc_init(&descs);
+	if (descfile && desc_load(&descs, descfile))
+		return 1;
 
-	return 0;
+	prof_init(&profs);
+	if (proffile && prof_load(&profs, proffile))
+		return 1;
+
+	if (infile && image_open(&img, infile))
+		return 1;
+
+	if (infile && basefile && image_open(&base_img, basefile)) {
+		image_close(&img);
+		return 1;
+	}
+
+	if (num_buses == 1)
+		ret = flash_bus(&buses[0]);
+	else {
+		/* one thread per CAN bus sharing the image and the flash plans */
+		for (i = 0; i < num_buses; i++) {
+			snprintf(buses[i].tag, SESSION_TAG_LEN, "[%.*s] ",
+				 IFNAMSIZ - 1, buses[i].ifname);
+			if (pthread_create(&buses[i].thread, NULL, bus_thread, &buses[i])) {
+				perror("pthread_create");
+				return 1;
+			}
+		}
+
+		for (i = 0; i < num_buses; i++)
+			pthread_join(buses[i].thread, NULL);
+
+		printf("\nsummary:\n\n");
+		for (i = 0; i < num_buses; i++) {
+			printf(" %-*s %s (%d of %d modules %s)\n", IFNAMSIZ, buses[i].ifname,
+			       buses[i].ret ? "FAILED" : "ok",
+			       buses[i].modules - buses[i].failed, buses[i].modules,
+			       audit ? "verified" : "flashed");
+			ret |= buses[i].ret;
+		}
+	}
+
+	if (!ret && !query)
+		printf("\ndone.\n\n");
+
+	if (tr) {
+		if (sumfile && trace_summary(tr, sumfile))
+			ret = 1;
+		if (tracefile && trace_chrome(tr, tracefile))
+			ret = 1;
+		trace_free(tr);
+	}
+
+	for (i = 0; i < 256; i++)
+		plan_free(&plans[i]);
+	if (descfile)
+		desc_save(&descs, descfile);
+	desc_free(&descs);
+	if (proffile)
+		prof_save(&profs, proffile);
+	prof_free(&profs);
+
+	image_close(&base_img);
+	image_close(&img);
+
+	return ret;
 }
@@ -25,6 +25,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -32,6 +33,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #include <sys/time.h>
 #include <sys/types.h>
@@ -39,77 +41,161 @@
 #include <linux/can/raw.h>
 
 #include "pcanflash.h"
+#include "pcanfunc.h"
 #include "pcanhw.h"
 #include "crc16.h"
+#include "image.h"
+#include "engine.h"
+#include "json.h"
+#include "blkscan.h"
+#include "rtt.h"
+
+/* JSON descriptor frame gap in us - doubled after lost frames */
+#define JSON_GAP_MIN 125
+#define JSON_GAP_MAX 2000
+
+/* collect the completion of a synchronous engine operation */
+struct wait_result {
+	int err;
+	struct can_frame cf;
+};
+
+static void wait_done(void *ctx, int err, const struct can_frame *cf)
+{
+	struct wait_result *res = ctx;
 
-#define JSON_BUF_LEN 8000
+	res->err = err;
+	if (cf)
+		memcpy(&res->cf, cf, sizeof(struct can_frame));
+}
 
-int query_modules(int s, struct can_frame *modules)
+struct query_result {
+	engine_t *eng;
+	struct can_frame *modules;
+	int entries;
+	int expected; /* stop the query after this number of modules */
+	const uint8_t *ids; /* stop the query when all these modules replied */
+	int err;
+};
+
+/* check whether all expected modules have replied */
+static int query_complete(struct query_result *res)
 {
-	int entries = 0;
-	int have_rx = 1;
-	int my_id, ret;
-	fd_set rdfs;
-	struct timeval tv;
-	struct can_frame frame;
+	int i, found = 0;
 
-	/* send module query request */
-	memset(&frame, 0, sizeof(struct can_frame));
+	if (res->expected && (res->entries >= res->expected))
+		return 1;
 
-	frame.can_id = CAN_ID;
-	frame.can_dlc = 3;
-	frame.data[0] = 0x80;
-	frame.data[1] = 0x00;
-	frame.data[2] = 0x06;
-
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
+	if (!res->ids)
+		return 0;
+
+	for (i = 0; i < MAX_MODULES; i++) {
+		if (!res->ids[i])
+			continue;
+		if (!res->modules[i].can_id)
+			return 0;
+		found++;
 	}
 
-	while (have_rx) {
+	return found;
+}
 
-		have_rx = 0;
-		FD_ZERO(&rdfs);
-		FD_SET(s, &rdfs);
-		tv.tv_sec = 1; /* 1s timeout */
-		tv.tv_usec = 0;
+static void query_reply(void *ctx, int err, const struct can_frame *cf)
+{
+	struct query_result *res = ctx;
+	struct can_frame *module;
+	int my_id;
 
-		ret = select(s+1, &rdfs, NULL, NULL, &tv);
-		if (ret < 0) {
-			perror("select");
-			exit(1);
-		}
+	if (err)
+		res->err = 1;
 
-		if (FD_ISSET(s, &rdfs)) {
-			have_rx = 1;
-			ret = read(s, &frame, sizeof(struct can_frame));
-			if (ret < 0) {
-				perror("read");
-				exit(1);
-			}
-
-			if ((frame.data[0] & 0xC0 != 0xC0) ||
-			    (frame.data[2] != 0x06) ||
-			    (frame.can_dlc != 8))
-			{
-				fprintf(stderr, "received wrong module query!\n");
-				exit(1);
-			}
-			my_id = frame.data[1] & MAX_MODULES_MASK;
-
-			if ((modules + my_id)->can_id)
-			{
-				fprintf(stderr, "received second module with ID %d!\n", my_id);
-				exit(1);
-			}
-			frame.can_dlc = NO_DATA_LEN; /* prepare data mode storage */
-			memcpy(modules + my_id, &frame, sizeof(struct can_frame));
-			entries++;
+	/* bus is quiet or error */
+	if (!cf)
+		return;
+
+	my_id = cf->data[1] & MAX_MODULES_MASK;
+	module = res->modules + my_id;
+
+	if (module->can_id) {
+		fprintf(stderr, "received second module with ID %d!\n", my_id);
+		res->err = 1;
+		return;
+	}
+
+	memcpy(module, cf, sizeof(struct can_frame));
+	module->can_dlc = NO_DATA_LEN; /* prepare data mode storage */
+	res->entries++;
+
+	if (query_complete(res))
+		engine_query_stop(res->eng);
+}
+
+/* probe the given module ids which did not reply to the query */
+static int probe_modules(engine_t *eng, struct can_frame *modules, int timeout,
+			 const uint8_t *ids)
+{
+	struct wait_result res[MAX_MODULES];
+	int i, found = 0;
+
+	for (i = 0; i < MAX_MODULES; i++) {
+		res[i].err = 1;
+		if (!ids[i] || modules[i].can_id)
+			continue;
+		if (engine_status(eng, i, timeout, wait_done, &res[i]))
+			return -1;
+	}
+
+	if (engine_run(eng))
+		return -1;
+
+	for (i = 0; i < MAX_MODULES; i++) {
+		if (!res[i].err) {
+			printf("module id %d replied to the status request but not to the query\n", i);
+			found++;
 		}
 	}
 
-	return entries;
+	return found;
+}
+
+/*
+ * Send the module query request and wait for quiet ms without replies.
+ * The query ends early when the expected number of modules or all
+ * module ids from the ids list have replied. Missing modules from the
+ * ids list are probed directly and queried again when they reply.
+ */
+int query_modules(engine_t *eng, struct can_frame *modules, int quiet, int expected,
+		  const uint8_t *ids)
+{
+	struct query_result res;
+	int probed;
+
+	res.eng = eng;
+	res.modules = modules;
+	res.entries = 0;
+	res.expected = expected;
+	res.ids = ids;
+	res.err = 0;
+
+	if (engine_query(eng, quiet, query_reply, &res) || engine_run(eng) || res.err)
+		return -1;
+
+	if (!ids || query_complete(&res))
+		return res.entries;
+
+	probed = probe_modules(eng, modules, quiet, ids);
+	if (probed < 0)
+		return -1;
+
+	/* the query reply of these modules got lost - ask again */
+	if (probed) {
+		memset(modules, 0, MAX_MODULES * sizeof(struct can_frame));
+		res.entries = 0;
+		if (engine_query(eng, quiet, query_reply, &res) || engine_run(eng) || res.err)
+			return -1;
+	}
+
+	return res.entries;
 }
 
 void init_set_cmd(struct can_frame *frame)
@@ -121,7 +207,7 @@ void init_set_cmd(struct can_frame *frame)
 	frame->data[7] = 0x00;
 }
 
-void set_startaddress(int s, uint8_t module_id, uint32_t addr)
+int set_startaddress(engine_t *eng, uint8_t module_id, uint32_t addr)
 {
 	struct can_frame frame;
 
@@ -132,13 +218,10 @@ void set_startaddress(int s, uint8_t module_id, uint32_t addr)
 	frame.data[5] = (addr >> 8) & 0xFF;
 	frame.data[6] = addr & 0xFF;
 
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	return engine_send(eng, &frame);
 }
 
-void set_blocksize(int s, uint8_t module_id, uint32_t size)
+int set_blocksize(engine_t *eng, uint8_t module_id, uint32_t size)
 {
 	struct can_frame frame;
 
@@ -149,13 +232,10 @@ void set_blocksize(int s, uint8_t module_id, uint32_t size)
 	frame.data[5] = (size >> 8) & 0xFF;
 	frame.data[6] = size & 0xFF;
 
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	return engine_send(eng, &frame);
 }
 
-void set_checksum(int s, uint8_t module_id, uint16_t csum)
+int set_checksum(engine_t *eng, uint8_t module_id, uint16_t csum)
 {
 	struct can_frame frame;
 
@@ -165,14 +245,11 @@ void set_checksum(int s, uint8_t module_id, uint16_t csum)
 	frame.data[4] = (csum >> 8) & 0xFF;
 	frame.data[5] = csum & 0xFF;
 	frame.data[6] = 0;
-    
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+
+	return engine_send(eng, &frame);
 }
 
-void erase_sector(int s, uint8_t module_id)
+int erase_sector(engine_t *eng, uint8_t module_id)
 {
 	struct can_frame frame;
 
@@ -182,14 +259,11 @@ void erase_sector(int s, uint8_t module_id)
 	frame.data[4] = 0x55;
 	frame.data[5] = 0;
 	frame.data[6] = 0;
-    
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+
+	return engine_send(eng, &frame);
 }
 
-void start_programming(int s, uint8_t module_id)
+int start_programming(engine_t *eng, uint8_t module_id)
 {
 	struct can_frame frame;
 
@@ -199,14 +273,11 @@ void start_programming(int s, uint8_t module_id)
 	frame.data[4] = 0x55;
 	frame.data[5] = 0;
 	frame.data[6] = 0;
-    
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+
+	return engine_send(eng, &frame);
 }
 
-void verify(int s, uint8_t module_id)
+int verify(engine_t *eng, uint8_t module_id)
 {
 	struct can_frame frame;
 
@@ -216,14 +287,11 @@ void verify(int s, uint8_t module_id)
 	frame.data[4] = 0;
 	frame.data[5] = 0;
 	frame.data[6] = 0;
-    
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+
+	return engine_send(eng, &frame);
 }
 
-void switch_to_bootloader(int s, uint8_t module_id)
+int switch_to_bootloader(engine_t *eng, uint8_t module_id)
 {
 	struct can_frame frame;
 
@@ -234,13 +302,10 @@ void switch_to_bootloader(int s, uint8_t module_id)
 	frame.data[5] = 0;
 	frame.data[6] = 0;
 
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	return engine_send(eng, &frame);
 }
 
-void reset_module(int s, uint8_t module_id)
+int reset_module(engine_t *eng, uint8_t module_id)
 {
 	struct can_frame frame;
 
@@ -251,13 +316,10 @@ void reset_module(int s, uint8_t module_id)
 	frame.data[5] = 0;
 	frame.data[6] = 0;
 
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	return engine_send(eng, &frame);
 }
 
-void end_programming(int s, uint8_t module_id)
+int end_programming(engine_t *eng, uint8_t module_id)
 {
 	struct can_frame frame;
 
@@ -268,297 +330,312 @@ void end_programming(int s, uint8_t module_id)
 	frame.data[5] = 0;
 	frame.data[6] = 0;
 
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	return engine_send(eng, &frame);
 }
 
-uint8_t get_status(int s, uint8_t module_id, struct can_frame *cf)
+int get_status(engine_t *eng, uint8_t module_id, struct can_frame *cf)
 {
-	struct can_frame frame;
-	fd_set rdfs;
-	struct timeval tv;
-	int ret;
+	struct wait_result res;
 
-	init_set_cmd(&frame);
-	frame.data[2] = module_id;
-	frame.data[3] = CAN2FLASH_STATE_REQUEST;
-	frame.data[4] = 0;
-	frame.data[5] = 0;
-	frame.data[6] = 0;
-    
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
+	if (engine_status(eng, module_id, STATUS_TIMEOUT, wait_done, &res) ||
+	    engine_run(eng))
+		return -1;
+
+	if (res.err) {
+		fprintf(stderr, "timeout in get_status process!\n");
+		return -1;
 	}
 
-	FD_ZERO(&rdfs);
-	FD_SET(s, &rdfs);
-	tv.tv_sec = 3; /* 3s timeout */
-	tv.tv_usec = 0;
+	if (cf)
+		memcpy(cf, &res.cf, sizeof(struct can_frame));
 
-	ret = select(s+1, &rdfs, NULL, NULL, &tv);
-	if (ret < 0) {
-		perror("select");
-		exit(1);
-	}
+	return res.cf.data[5];
+}
 
-	if (FD_ISSET(s, &rdfs)) {
-		ret = read(s, &frame, sizeof(struct can_frame));
-		if (ret < 0) {
-			perror("read");
-			exit(1);
-		}
+/* poll the module status after a switch into the bootloader until it replies */
+int poll_status(engine_t *eng, uint8_t module_id, struct can_frame *cf)
+{
+	struct wait_result res;
+	uint64_t end = rtt_now() + SETTLE_TIMEOUT * 1000ULL;
+	int poll_ms = POLL_MIN;
+
+	do {
+		if (engine_status(eng, module_id, poll_ms, wait_done, &res) ||
+		    engine_run(eng))
+			return -1;
 
-		if (cf)
-			memcpy(cf, &frame, sizeof(struct can_frame));
+		poll_ms *= 2;
+		if (poll_ms > POLL_MAX)
+			poll_ms = POLL_MAX;
+	} while ((res.err == ENGINE_TIMEOUT) && (rtt_now() < end));
 
-		return frame.data[5];
+	if (res.err) {
+		fprintf(stderr, "timeout in get_status process!\n");
+		return -1;
 	}
 
-	fprintf(stderr, "timeout in get_status process!\n");
-	exit(1);
+	if (cf)
+		memcpy(cf, &res.cf, sizeof(struct can_frame));
+
+	return res.cf.data[5];
 }
 
-/* simple JSON parsing for relevant content */
+/*
+ * Status after a probed block. A module which is overwhelmed by the block
+ * may not reply in time - the timeout reads as status 0 which rejects the
+ * block. Its late reply is dropped as it would complete the next request.
+ */
+static int probe_status(engine_t *eng, uint8_t module_id)
+{
+	struct wait_result res;
+
+	if (engine_status(eng, module_id, STATUS_TIMEOUT, wait_done, &res) ||
+	    engine_run(eng))
+		return -1;
+
+	if (res.err != ENGINE_TIMEOUT)
+		return res.err ? -1 : res.cf.data[5];
 
-#define J_HWTYPE "\"hwType\""
-#define J_BOOTLOADER "\"bootloader\""
-#define J_FIRMWARE "\"firmware\""
-#define J_HARDWARE "\"hardware\""
-#define J_DATAMODE "\"dataMode\""
-#define J_CANBERESET "\"canBeReset\""
+	if (engine_delay(eng, module_id, STATUS_TIMEOUT, wait_done, &res) ||
+	    engine_run(eng))
+		return -1;
+
+	return 0;
+}
 
-char *findjsonstring(char *buf, const char *jsontag)
+/*
+ * Transfer a block without programming it to check whether the module
+ * accepts this block size. Returns 0 when the module confirmed the
+ * checksum, 1 when the block was rejected or not answered and -1 on errors.
+ */
+int probe_block(engine_t *eng, uint8_t module_id, uint8_t hw_type, uint8_t ftd_len,
+		uint32_t addr, const uint8_t *buf, uint32_t blksz)
 {
-	char *ptr, *resultstr;
+	const uint8_t addr_len = SET_STARTADDR | SET_LENGTH;
+	blkscan_t scan;
+	int status;
+
+	scan_block(buf, blksz, &scan);
 
-	ptr = strstr(buf, jsontag);
-	if (ptr == NULL)
-		return NULL;
+	if (set_startaddress(eng, module_id, addr))
+		return -1;
 
-	/* hop behind the JSON tag */
-	ptr += strlen(jsontag);
+	status = get_status(eng, module_id, NULL);
+	if (status < 0)
+		return -1;
+	if ((status & SET_STARTADDR) != SET_STARTADDR)
+		return 1;
 
-	/* point to data content */
-	ptr = strchr(ptr, '"');
-	if (ptr == NULL)
-		return NULL;
+	if (set_blocksize(eng, module_id, blksz))
+		return -1;
 
-	ptr++;
-	resultstr = ptr;
+	status = get_status(eng, module_id, NULL);
+	if (status < 0)
+		return -1;
+	if ((status & addr_len) != addr_len)
+		return 1;
 
-	/* terminate string */
-	ptr = strchr(ptr, '"');
-	if (ptr == NULL)
-		return NULL;
+	if (send_block_data(eng, buf, blksz, has_hw_flags(hw_type, FDATA_INVERT), ftd_len) ||
+	    set_checksum(eng, module_id, scan.csum))
+		return -1;
 
-	*ptr = 0;
+	status = probe_status(eng, module_id);
+	if (status < 0)
+		return -1;
 
-	return resultstr;
+	return (status != (SET_CHECKSUM_OK | addr_len | SET_CHECKSUM));
 }
 
-void restorejsonstring(char **ptr)
+/* feed the JSON descriptor to the parser while it is received */
+struct json_result {
+	json_t js;
+	int err;
+	int frames;
+	int perr; /* parser error */
+};
+
+static void json_done(void *ctx, int err, const struct can_frame *cf)
 {
-	/* restore trailing double quote for next query */
-	*ptr += strlen(*ptr);
-	**ptr = '"';
+	struct json_result *res = ctx;
+
+	if (!cf) {
+		res->err = err;
+		return;
+	}
+
+	/* (re)started sequence */
+	if (cf->data[2] == 0x00) {
+		json_free(&res->js);
+		res->perr = 0;
+	}
+
+	res->frames++;
+	if (!res->perr)
+		res->perr = json_feed(&res->js, (const char *)&cf->data[3], 5);
 }
 
-uint8_t get_json_config(int s, uint8_t module_id, struct can_frame *modules, struct can_frame *cf)
+uint8_t get_json_config(engine_t *eng, uint8_t module_id, struct can_frame *modules, struct can_frame *cf,
+			uint32_t *blksz, const char *tag)
 {
-	struct can_frame frame;
-	fd_set rdfs;
-	struct timeval tv;
-
-	char buf[JSON_BUF_LEN];
-	char *ptr;
+	struct json_result res;
+	const char *val;
 	unsigned int hwType;
+	unsigned int gap;
+	uint8_t ret = 1;
 
-	unsigned char sn = 0; /* JSON PDU counter */
-	unsigned char rxsn; /* received JSON PDU counter */
-	unsigned int bufptr = 0;
-	int ret;
+	json_init(&res.js);
 
-	init_set_cmd(&frame);
-	frame.data[2] = module_id;
-	frame.data[3] = CAN2FLASH_GET_JSON_DESCRIPTOR;
-	frame.data[4] = 0x03; /* 1000 us, high byte */
-	frame.data[5] = 0xE8; /* 1000 us, low byte */
-	frame.data[6] = 0;
+	/* start with the smallest frame gap which worked on this bus */
+	gap = eng->json_gap ? eng->json_gap : JSON_GAP_MIN;
 
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	while (1) {
+		json_free(&res.js);
+		res.err = ENGINE_OK;
+		res.frames = 0;
+		res.perr = 0;
+
+		if (engine_json(eng, module_id, gap, STATUS_TIMEOUT,
+				json_done, &res) || engine_run(eng))
+			goto out_free;
+
+		if ((res.err != ENGINE_TIMEOUT) && (res.err != ENGINE_EPROTO))
+			break;
 
-	FD_ZERO(&rdfs);
-	FD_SET(s, &rdfs);
-	tv.tv_sec = 3; /* 3s timeout */
-	tv.tv_usec = 0;
+		/* no reply at all */
+		if ((res.err == ENGINE_TIMEOUT) && !res.frames)
+			break;
 
-json_read_loop:
+		if (gap >= JSON_GAP_MAX)
+			break;
 
-	ret = select(s+1, &rdfs, NULL, NULL, &tv);
-	if (ret < 0) {
-		perror("select");
-		exit(1);
+		gap *= 2;
 	}
 
-	if (FD_ISSET(s, &rdfs)) {
-		ret = read(s, &frame, sizeof(struct can_frame));
-		if (ret < 0) {
-			perror("read");
-			exit(1);
-		}
+	if (res.err == ENGINE_TIMEOUT)
+		fprintf(stderr, "timeout in get_status process!\n");
 
-		if ((frame.data[0] != 0x7F) || (frame.data[1] != 0xFF)) {
-			fprintf(stderr, "wrong header in in JSON reply string!\n");
-			exit(1);
-		}
+	if (res.err == ENGINE_EPROTO)
+		fprintf(stderr, "JSON reception error!\n");
 
-		rxsn = frame.data[2];
-		if (rxsn == 0x00) {
+	if (res.err)
+		goto out_free;
+
+	if (res.perr || !json_complete(&res.js)) {
+		fprintf(stderr, "JSON descriptor syntax error!\n");
+		goto out_free;
+	}
 
-			/* start sequence */
-			memset(buf, 0, sizeof(buf));
-			memcpy(buf, &frame.data[3], 5);
-			bufptr = 5;
-			sn = 0;
+	eng->json_gap = gap;
 
-		} else if ((rxsn == 0xFF) || (rxsn == sn + 1)) {
+	printf("%smodule id %02d (ppcan hw id %d)\n",
+	       tag, module_id,
+	       ((modules->data[0] << 2) | (modules->data[1] >> 6)) & 0xFF);
 
-			memcpy(&buf[bufptr], &frame.data[3], 5);
-			bufptr += 5;
-			sn = rxsn;
+	val = json_get(&res.js, "bootloader");
+	if (val)
+		printf("%s - bootloader %s\n", tag, val);
 
-			/* rxsn sequence is .. 0xFD 0xFE 0x01 0x02 .. */
-			if (sn == 0xFE)
-				sn = 0;
+	val = json_get(&res.js, "firmware");
+	if (val)
+		printf("%s - firmware %s\n", tag, val);
+
+	val = json_get(&res.js, "hwType");
+	if (val) {
+		if (sscanf(val, "%u", &hwType) == 1) {
+			hwType &= 0xFF;
+			cf->data[3] = hwType;
+			cf->data[4] = hwType;
+
+			printf("%s - hardware %d (%s) flash type %d (%s)\n",
+			       tag, cf->data[3], get_hw_name(cf->data[3]),
+			       cf->data[4], get_flash_name(cf->data[4]));
 
-			/* ensure buffer size and trailing zero */
-			if (bufptr >= (JSON_BUF_LEN - 6)) {
-				fprintf(stderr, "JSON buffer length overflow!\n");
-				exit(1);
-			}
 		} else {
-			fprintf(stderr, "JSON reception error!\n");
-			exit(1);
+			fprintf(stderr, "JSON descriptor parse error (hwType)!\n");
+			goto out_free;
 		}
+	}
 
-		if (rxsn == 0xFF) {
-			/* we are done */
-
-			//printf("JSON string (len %ld):\n%s\n", strlen(buf), buf);
-
-			printf("module id %02d (ppcan hw id %d)\n",
-			       module_id,
-			       ((modules->data[0] << 2) | (modules->data[1] >> 6)) & 0xFF);
-
-			ptr = findjsonstring(buf, J_BOOTLOADER);
-			if (ptr) {
-				printf(" - bootloader %s\n", ptr);
-				restorejsonstring(&ptr);
-			}
-
-			ptr = findjsonstring(buf, J_FIRMWARE);
-			if (ptr) {
-				printf(" - firmware %s\n", ptr);
-				restorejsonstring(&ptr);
-			}
-
-			ptr = findjsonstring(buf, J_HWTYPE);
-			if (ptr) {
-				if (sscanf(ptr, "%d", &hwType) == 1) {
-					hwType &= 0xFF;
-					cf->data[3] = hwType;
-					cf->data[4] = hwType;
-
-					printf(" - hardware %d (%s) flash type %d (%s)\n",
-					       cf->data[3], get_hw_name(cf->data[3]),
-					       cf->data[4], get_flash_name(cf->data[4]));
-
-				} else {
-					fprintf(stderr, "JSON buffer parse error (%s)!\n", J_HWTYPE);
-					exit(1);
-				}
-				restorejsonstring(&ptr);
-			}
-
-			ptr = findjsonstring(buf, J_DATAMODE);
-			if (ptr) {
-				if (modules->can_dlc != NO_DATA_LEN) {
-					fprintf(stderr, "JSON datamode not empty!\n");
-					exit(1);
-				}
-
-				if (*ptr == '0')
-					modules->can_dlc = DATA_LEN6;
-				else if (*ptr == '1')
-					modules->can_dlc = DATA_LEN8;
-				else {
-					fprintf(stderr, "JSON unknown datamode '%c'!\n", *ptr);
-					exit(1);
-				}
-				printf(" - datamode %c => flash transfer data len %d\n",
-				       *ptr, modules->can_dlc);
-
-				restorejsonstring(&ptr);
-			}
+	val = json_get(&res.js, "dataMode");
+	if (val) {
+		if (modules->can_dlc != NO_DATA_LEN) {
+			fprintf(stderr, "JSON datamode not empty!\n");
+			goto out_free;
+		}
 
-			return 0;
+		if (*val == '0')
+			modules->can_dlc = DATA_LEN6;
+		else if (*val == '1')
+			modules->can_dlc = DATA_LEN8;
+		else if (*val == '2')
+			modules->can_dlc = DATA_LEN64;
+		else {
+			fprintf(stderr, "JSON unknown datamode '%c'!\n", *val);
+			goto out_free;
 		}
+		printf("%s - datamode %c => flash transfer data len %d\n",
+		       tag, *val, modules->can_dlc);
+	}
 
-		goto json_read_loop;
+	val = json_get(&res.js, "maxBlockSize");
+	if (val) {
+		if (sscanf(val, "%u", blksz) != 1) {
+			fprintf(stderr, "JSON descriptor parse error (maxBlockSize)!\n");
+			goto out_free;
+		}
+		printf("%s - max. block size %u\n", tag, *blksz);
 	}
 
-	fprintf(stderr, "timeout in get_status process!\n");
-	exit(1);
+	ret = 0;
+out_free:
+	json_free(&res.js);
+	return ret;
 }
 
-int eval_modules(int s, int module_id, struct can_frame *modules)
+/* cf is the status reply of the module - the JSON descriptor may update it */
+int eval_modules(engine_t *eng, int module_id, struct can_frame *modules, struct can_frame *cf,
+		 uint32_t *blksz, const char *tag)
 {
-	struct can_frame cf;
-
-	/* get status for this found module */
-	get_status(s, module_id, &cf);
-
 	/* hardware type or flash type is 250 => get info via JSON config string */
-	if ((cf.data[3] == 250) || (cf.data[4] == 250)) {
-		if (get_json_config(s, module_id, modules, &cf)) {
-			fprintf(stderr, "\nError reading the JSON configuration string!\n\n");
-			exit(1);
+	if ((cf->data[3] == 250) || (cf->data[4] == 250)) {
+		if (get_json_config(eng, module_id, modules, cf, blksz, tag)) {
+			fprintf(stderr, "\n%sError reading the JSON configuration string!\n\n", tag);
+			return 1;
 		}
 	} else {
-		printf("module id %02d (ppcan hw id %d)\n",
-		       module_id,
+		printf("%smodule id %02d (ppcan hw id %d)\n",
+		       tag, module_id,
 		       ((modules->data[0] << 2) | (modules->data[1] >> 6)) & 0xFF);
 
-		printf(" - date %02X.%02X.20%02X bootloader v%d.%d\n",
-		       modules->data[3], modules->data[4], modules->data[5],
+		printf("%s - date %02X.%02X.20%02X bootloader v%d.%d\n",
+		       tag, modules->data[3], modules->data[4], modules->data[5],
 		       modules->data[6] >> 5, modules->data[6] & 0x1F);
 
-		printf(" - hardware %d (%s) flash type %d (%s)\n",
-		       cf.data[3], get_hw_name(cf.data[3]),
-		       cf.data[4], get_flash_name(cf.data[4]));
+		printf("%s - hardware %d (%s) flash type %d (%s)\n",
+		       tag, cf->data[3], get_hw_name(cf->data[3]),
+		       cf->data[4], get_flash_name(cf->data[4]));
 	}
 	/* check if hardware fits to known flash id type */
-	if (check_flash_id_type(cf.data[3], cf.data[4])) {
-		fprintf(stderr, "\nFlash ID type does not match the hardware ID!\n\n");
+	if (check_flash_id_type(cf->data[3], cf->data[4])) {
+		fprintf(stderr, "\n%sFlash ID type does not match the hardware ID!\n\n", tag);
 		return 1;
 	}
 
 	/* store hw_type for this module_id index in data[7] */
-	modules->data[7] = cf.data[3];
+	modules->data[7] = cf->data[3];
 
 	return 0;
 }
 
-void write_crc_array(uint8_t *buf, FILE *infile, uint32_t crc_start)
+void write_crc_array(uint8_t *buf, size_t len, const image_t *img, uint32_t crc_start)
 {
 	crc_array_t *ca = (crc_array_t *)buf;
-	int i;
+	int i, count;
+
+	if (len < sizeof(crc_array_t)) {
+		fprintf(stderr, " CRC array exceeds flash block - omit patching of CRC value.\n");
+		return;
+	}
 
 	if (strcmp((const char *)ca->str, CRC_IDENT_STRING)) {
 		fprintf(stderr, " no CRC Ident string found - omit patching of CRC value.\n");
@@ -568,9 +645,14 @@ void write_crc_array(uint8_t *buf, FILE *infile, uint32_t crc_start)
 	printf(" CRC array ver=0x%X D/M/Y=%d/%d/%d mode=%d found at 0x%X\n",
 	       ca->version, ca->day, ca->month, ca->year, ca->mode, crc_start);
 
+	/* only patch the entries inside this flash block */
+	count = (len - offsetof(crc_array_t, block)) / sizeof(block_t);
+	if (count > ca->count)
+		count = ca->count;
+
 	if ((ca->mode == 1) || (ca->mode == 3) || (ca->mode == 4)) {
-		for (i = 0; i < ca->count; i++) {
-			ca->block[i].crc = calc_crc16(infile, ca->block[i].address,
+		for (i = 0; i < count; i++) {
+			ca->block[i].crc = calc_crc16(img, ca->block[i].address,
 						      ca->block[i].len);
 			printf(" CRC block[%d] .address=0x%X  .len=0x%X	 .crc=0x%X\n",
 			       i, ca->block[i].address, ca->block[i].len, ca->block[i].crc);
@@ -580,34 +662,67 @@ void write_crc_array(uint8_t *buf, FILE *infile, uint32_t crc_start)
 		       ca->mode);
 }
 
-void write_block(int s, int dry_run, uint8_t module_id, uint32_t offset, uint32_t blksz,
-		 uint8_t *buf, uint32_t alternating_xor_flip, uint8_t ftd_len)
+/* valid CAN FD payload length for len bytes */
+static uint8_t canfd_len(uint8_t len)
 {
-	struct can_frame frame;
+	static const uint8_t fd_len[] = { 8, 12, 16, 20, 24, 32, 48, 64 };
+	int i;
+
+	if (len <= 8)
+		return len;
+
+	for (i = 0; len > fd_len[i]; i++)
+		;
+
+	return fd_len[i];
+}
+
+static int send_block_data_fd(engine_t *eng, const uint8_t *buf, uint32_t blksz,
+			      uint32_t alternating_xor_flip)
+{
+	struct canfd_frame frame;
 	int i, j, xor_flip;
-	uint8_t status;
-	uint16_t csum;
 
-	for (i = 0, csum = 0; i < blksz; i++)
-		csum = (csum + *(buf +i)) & 0xFFFFU;
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = CAN_ID;
+	frame.flags = CANFD_BRS;
+	xor_flip = 0;
 
-	printf ("writing non empty block at offset 0x%X with csum 0x%04X\n",
-		(unsigned int)offset, (unsigned int)csum);
+	for (i = 0; i < blksz; i += DATA_LEN64, xor_flip ^= 1) {
 
-	set_startaddress(s, module_id, offset);
-	status = get_status(s, module_id, NULL);
-	if ((status & SET_STARTADDR) != (SET_STARTADDR)) {
-		fprintf(stderr, "flash1 - wrong status %02X!\n", status);
-		exit(1);
-	}
-	
-	set_blocksize(s, module_id, blksz);
-	status = get_status(s, module_id, NULL);
-	if ((status & (SET_STARTADDR | SET_LENGTH)) != (SET_STARTADDR | SET_LENGTH)) {
-		fprintf(stderr, "flash2 - wrong status %02X!\n", status);
-		exit(1);
+		uint8_t len = DATA_LEN64;
+
+		if (i + len > blksz) {
+			/* last frame - pad to a valid CAN FD length */
+			len = blksz - i;
+			memset(frame.data, 0, DATA_LEN64);
+		}
+		frame.len = canfd_len(len);
+
+		for (j = 0; j < len; j++)
+			frame.data[j] = *(buf + i + j);
+
+		if ((xor_flip) && (alternating_xor_flip)) {
+			for (j = 0; j < len; j++)
+				frame.data[j] ^= 0xFF;
+		}
+
+		if (engine_send_fd(eng, &frame))
+			return -1;
 	}
 
+	return 0;
+}
+
+int send_block_data(engine_t *eng, const uint8_t *buf, uint32_t blksz,
+		     uint32_t alternating_xor_flip, uint8_t ftd_len)
+{
+	struct can_frame frame;
+	int i, j, xor_flip;
+
+	if (ftd_len == DATA_LEN64)
+		return send_block_data_fd(eng, buf, blksz, alternating_xor_flip);
+
 	frame.can_id = CAN_ID;
 	frame.can_dlc = 8;
 	xor_flip = 0;
@@ -636,153 +751,29 @@ void write_block(int s, int dry_run, uint8_t module_id, uint32_t offset, uint32_
 				frame.data[j + (8 - ftd_len)] ^= 0xFF;
 		}
 
-		if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-			perror("write");
-			exit(1);
-		}
-	}
-
-	status = get_status(s, module_id, NULL);
-	if ((status & (SET_STARTADDR | SET_LENGTH)) != (SET_STARTADDR | SET_LENGTH)) {
-		fprintf(stderr, "flash3 - wrong status %02X!\n", status);
-		exit(1);
-	}
-	
-	set_checksum(s, module_id, csum);
-	status = get_status(s, module_id, NULL);
-	if (status != (SET_CHECKSUM_OK | SET_STARTADDR | SET_LENGTH | SET_CHECKSUM)) {
-		fprintf(stderr, "flash4 - wrong status %02X!\n", status);
-		exit(1);
-	}
-	
-	if (!dry_run) {
-		start_programming(s, module_id);
-		status = get_status(s, module_id, NULL);
-		if (status != (SET_CHECKSUM_OK)) {
-			fprintf(stderr, "flash5 - wrong status %02X!\n", status);
-			exit(1);
-		}
-	
-		verify(s, module_id);
-		status = get_status(s, module_id, NULL);
-		if (status != (SET_CHECKSUM_OK | SET_VERIFY_OK)) {
-			fprintf(stderr, "flash6 - wrong status %02X!\n", status);
-			exit(1);
-		}
-	}
-}
-
-void erase_block(int s, int dry_run, uint8_t module_id, uint32_t startaddr, uint32_t blksz)
-{
-	uint8_t status;
-
-	printf ("erasing block at startaddr 0x%06X with block size 0x%06X\n",
-		(unsigned int)startaddr, (unsigned int)blksz);
-
-	set_startaddress(s, module_id, startaddr);
-	status = get_status(s, module_id, NULL);
-	if ((!dry_run) && ((status & SET_STARTADDR) != SET_STARTADDR)) {
-		fprintf(stderr, "erase1 - wrong status %02X!\n", status);
-		exit(1);
+		if (engine_send(eng, &frame))
+			return -1;
 	}
-	
-	set_blocksize(s, module_id, blksz);
-	status = get_status(s, module_id, NULL);
-	if ((!dry_run) && ((status & (SET_STARTADDR | SET_LENGTH)) != (SET_STARTADDR | SET_LENGTH))) {
-		fprintf(stderr, "erase2 - wrong status %02X!\n", status);
-		exit(1);
-	}
-	
-	if (!dry_run) {
-		erase_sector(s, module_id);
-		status = get_status(s, module_id, NULL);
-		if ((status & SET_ERASE_OK) != SET_ERASE_OK) {
-			fprintf(stderr, "erase3 - wrong status %02X!\n", status);
-			exit(1);
-		}
-	}
-}
-
-void erase_flashblocks(int s, int dry_run, FILE *infile, uint8_t module_id,
-		       uint8_t hw_type, int index)
-{
-	const fblock_t *fblock;
-	uint8_t data;
-	int i;
-
-	const hw_t *hwt = get_hw(hw_type);
-	const uint32_t flash_offset = get_flash_offset(hw_type);
-
-	if (hwt)
-		fblock = &hwt->flashblocks[index];
-	else {
-		fprintf(stderr, "bad flashblocks entry found for hardware type %d (%s)!\n",
-			hw_type, get_hw_name(hw_type));
-		exit(1);
-	}
-
-	/* skip handling of this flash block? */
-	if (fblock->skipped)
-		return;
 
-	/* check for wrong flash_offset configuration */
-	if (fblock->start < flash_offset) {
-		fprintf(stderr, "bad flashblock offset 0x%X for flashblock "
-			"start at 0x%X found for hardware type %d (%s)!\n",
-			flash_offset, fblock->start,
-			hw_type, get_hw_name(hw_type));
-		exit(1);
-	}
-
-	/* check block in bin-file */
-	if (fseek(infile, fblock->start - flash_offset, SEEK_SET))
-		return;
-
-	for (i = 0; i < fblock->len; i++) {
-		if (fread(&data, 1, 1, infile) != 1) {
-			/* file ended but was empty so far -> no action */
-			return;
-		}
-		if (data != EMPTY)
-			break;
-	}
-
-	/* empty block (all bytes are EMPTY / 0xFFU) -> no action */
-	if (i == fblock->len)
-		return;
-
-	erase_block(s, dry_run, module_id, fblock->start, fblock->len);
+	return 0;
 }
 
-int check_ch_name(FILE *infile, uint8_t hw_type)
+int check_ch_name(const image_t *img, uint8_t hw_type)
 {
 	const hw_t *hwt = get_hw(hw_type);
-	char buf[HW_NAME_MAX_LEN + 2];
-
-	memset(buf, 0, sizeof(buf));
+	const uint8_t *ptr;
 
 	if (!hwt)
 		return 1;
 
-	rewind(infile);
-
-	while (1) {
-
-		if (fread(buf, 1, 1, infile) != 1)
-			return 1;
-
-		/* PCAN devices always start with 'P' */
-		if (buf[0] != 'P')
-			continue;
-
-		if (fread(&buf[1], 1, HW_NAME_MAX_LEN - 1, infile) != HW_NAME_MAX_LEN - 1)
-			return 1;
+	/* search the ch_filename of this hardware type in the bin-file */
+	ptr = memmem(img->data, img->len, hwt->ch_file, strlen(hwt->ch_file));
+	if (!ptr)
+		return 1;
 
-		if (!strncmp(buf, hwt->ch_file, strlen(hwt->ch_file)))
-			return 0; /* match */
+	/* the name has to fit into a complete HW_NAME_MAX_LEN entry */
+	if (ptr + HW_NAME_MAX_LEN > img->data + img->len)
+		return 1;
 
-		/* no match -> rewind back behind the 'P' */
-		if (fseek(infile, ftell(infile) - (HW_NAME_MAX_LEN - 1), SEEK_SET))
-			return 1;
-	}
+	return 0; /* match */
 }
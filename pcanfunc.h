@@ -26,24 +26,31 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 #include <linux/can.h>
 
-int query_modules(int s, struct can_frame *modules);
+#include "image.h"
+#include "engine.h"
+
+int query_modules(engine_t *eng, struct can_frame *modules, int quiet, int expected,
+		  const uint8_t *ids);
 void init_set_cmd(struct can_frame *frame);
-void set_startaddress(int s, uint8_t module_id, uint32_t addr);
-void set_blocksize(int s, uint8_t module_id, uint32_t size);
-void set_checksum(int s, uint8_t module_id, uint16_t csum);
-void erase_sector(int s, uint8_t module_id);
-void start_programming(int s, uint8_t module_id);
-void verify(int s, uint8_t module_id);
-void switch_to_bootloader(int s, uint8_t module_id);
-void reset_module(int s, uint8_t module_id);
-void end_programming(int s, uint8_t module_id);
-uint8_t get_status(int s, uint8_t module_id, struct can_frame *cf);
-uint8_t get_json_config(int s, uint8_t module_id, struct can_frame *modules, struct can_frame *cf);
-int eval_modules(int s, int module_id, struct can_frame *modules);
-void write_crc_array(uint8_t *buf, FILE *infile, uint32_t crc_start);
-void write_block(int s, int dry_run, uint8_t module_id, uint32_t offset, uint32_t blksz, uint8_t *buf, uint32_t alternating_xor_flip, uint8_t ftd_len);
-void erase_block(int s, int dry_run, uint8_t module_id, uint32_t startaddr, uint32_t blksz);
-void erase_flashblocks(int s, int dry_run, FILE *infile, uint8_t module_id, uint8_t hw_type, int index);
-int check_ch_name(FILE *infile, uint8_t hw_type);
+int set_startaddress(engine_t *eng, uint8_t module_id, uint32_t addr);
+int set_blocksize(engine_t *eng, uint8_t module_id, uint32_t size);
+int set_checksum(engine_t *eng, uint8_t module_id, uint16_t csum);
+int erase_sector(engine_t *eng, uint8_t module_id);
+int start_programming(engine_t *eng, uint8_t module_id);
+int verify(engine_t *eng, uint8_t module_id);
+int switch_to_bootloader(engine_t *eng, uint8_t module_id);
+int reset_module(engine_t *eng, uint8_t module_id);
+int end_programming(engine_t *eng, uint8_t module_id);
+int get_status(engine_t *eng, uint8_t module_id, struct can_frame *cf);
+int poll_status(engine_t *eng, uint8_t module_id, struct can_frame *cf);
+int probe_block(engine_t *eng, uint8_t module_id, uint8_t hw_type, uint8_t ftd_len,
+		uint32_t addr, const uint8_t *buf, uint32_t blksz);
+uint8_t get_json_config(engine_t *eng, uint8_t module_id, struct can_frame *modules, struct can_frame *cf, uint32_t *blksz, const char *tag);
+int eval_modules(engine_t *eng, int module_id, struct can_frame *modules, struct can_frame *cf,
+		 uint32_t *blksz, const char *tag);
+void write_crc_array(uint8_t *buf, size_t len, const image_t *img, uint32_t crc_start);
+int send_block_data(engine_t *eng, const uint8_t *buf, uint32_t blksz, uint32_t alternating_xor_flip, uint8_t ftd_len);
+int check_ch_name(const image_t *img, uint8_t hw_type);
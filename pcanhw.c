@@ -75,6 +75,16 @@ uint32_t get_max_blocksize(uint8_t hw_type)
 	return 0; /* disabled */
 }
 
+uint32_t get_erase_timeout(uint8_t hw_type)
+{
+	const hw_t *hwt = get_hw(hw_type);
+
+	if (hwt)
+		return hwt->erase_timeout;
+
+	return 0; /* default */
+}
+
 uint32_t has_hw_flags(uint8_t hw_type, const uint32_t flags)
 {
 	const hw_t *hwt = get_hw(hw_type);
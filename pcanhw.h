@@ -48,6 +48,7 @@ typedef struct {
 #define NO_DATA_LEN 0
 #define DATA_LEN6 6
 #define DATA_LEN8 8
+#define DATA_LEN64 64 /* CAN FD data frames */
 
 typedef struct {
 	const char name[HW_NAME_MAX_LEN];
@@ -57,6 +58,7 @@ typedef struct {
 	const uint32_t flash_offset;
 	const uint32_t max_blocksize;
 	const uint8_t flash_id_type;
+	const uint32_t erase_timeout; /* ms for a sector erase */
 	const int num_flashblocks;
 	const fblock_t *flashblocks;
 } hw_t;
@@ -68,11 +70,15 @@ typedef struct {
 #define RESET_AFTER_FLASH	(1<<2)
 #define END_PROGRAMMING		(1<<3)
 #define DATA_MODE8		(1<<4)
+#define PIPELINE_BLOCKS		(1<<5) /* accepts addr/len/data/csum back-to-back */
+#define DATA_MODE64		(1<<6) /* accepts 64 byte CAN FD data frames */
+#define MULTI_SECTOR_ERASE	(1<<7) /* erases contiguous sectors with one command */
 
 const hw_t *get_hw(uint8_t hw_type);
 uint32_t get_crc_startpos(uint8_t hw_type);
 uint32_t get_flash_offset(uint8_t hw_type);
 uint32_t get_max_blocksize(uint8_t hw_type);
+uint32_t get_erase_timeout(uint8_t hw_type);
 uint32_t has_hw_flags(uint8_t hw_type, const uint32_t flags);
 const char *get_hw_name(uint8_t hw_type);
 const char *get_flash_name(uint8_t flash_type);
@@ -0,0 +1,333 @@
+/*
+ * pcfbench.c - microbenchmarks for the pcanflash host side
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+#include <linux/can.h>
+
+#include "pcanflash.h"
+#include "pcanfunc.h"
+#include "pcanhw.h"
+#include "crc16.h"
+#include "image.h"
+#include "engine.h"
+#include "json.h"
+#include "blkscan.h"
+
+#define BENCH_RUNS 5 /* the fastest run counts */
+#define BENCH_MIN_NS 50000000ULL /* min. duration of a run */
+#define BENCH_HW_TYPE 42 /* PCAN-Router Pro FD */
+#define BENCH_BLKSZ 4096 /* fits into the engine tx queue */
+#define SCAN_BLKSZ 512
+#define SCAN_LEN 0x100000
+#define CRC_START 0x8000 /* application range of a CRC array entry */
+#define CRC_LEN 0x78000
+
+typedef struct {
+	const char *name;
+	void (*run)(void);
+	size_t bytes; /* processed bytes per call */
+	size_t frames; /* CAN frames per call - 0 when not applicable */
+	double ns_per_byte;
+	double frames_per_s;
+} bench_t;
+
+static image_t img;
+static uint8_t *empty;
+static engine_t eng;
+static char json[1024];
+static size_t json_len;
+static volatile unsigned long sink; /* keeps the results alive */
+
+extern int optind, opterr, optopt;
+
+void print_usage(char *prg)
+{
+	fprintf(stderr, "\nUsage: %s [-j <file.json>]\n\n", prg);
+	fprintf(stderr, "Options: -j <file.json> (write the results as JSON for trend tracking)\n");
+	fprintf(stderr, "\n");
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run_crc16(void)
+{
+	sink += calc_crc16(&img, CRC_START, CRC_LEN);
+}
+
+static void scan(const uint8_t *data)
+{
+	blkscan_t res;
+	size_t i;
+
+	for (i = 0; i < SCAN_LEN; i += SCAN_BLKSZ) {
+		scan_block(data + i, SCAN_BLKSZ, &res);
+		sink += res.csum + res.empty;
+	}
+}
+
+static void run_scan_empty(void)
+{
+	scan(empty);
+}
+
+static void run_scan_data(void)
+{
+	scan(img.data);
+}
+
+static void send_block(uint8_t ftd_len)
+{
+	if (send_block_data(&eng, img.data, BENCH_BLKSZ, 1, ftd_len))
+		exit(1);
+
+	/* drop the queued frames - nothing is sent */
+	sink += eng.tx_head;
+	eng.tx_head = 0;
+	eng.tx_tail = 0;
+}
+
+static void run_pack6(void)
+{
+	send_block(DATA_LEN6);
+}
+
+static void run_pack8(void)
+{
+	send_block(DATA_LEN8);
+}
+
+static void run_pack64(void)
+{
+	send_block(DATA_LEN64);
+}
+
+static void run_ch_name(void)
+{
+	sink += check_ch_name(&img, BENCH_HW_TYPE);
+}
+
+static void run_json(void)
+{
+	json_t js;
+	size_t pos;
+
+	/* fed in the 5 byte chunks of the descriptor frames */
+	json_init(&js);
+	for (pos = 0; pos < json_len; pos += 5)
+		json_feed(&js, &json[pos], (json_len - pos < 5) ? json_len - pos : 5);
+
+	sink += json_complete(&js);
+	sink += (json_get(&js, "hwType") != NULL);
+	sink += (json_get(&js, "dataMode") != NULL);
+	json_free(&js);
+}
+
+static bench_t benches[] = {
+	{ "crc16", run_crc16, CRC_LEN, 0 },
+	{ "scan_empty", run_scan_empty, SCAN_LEN, 0 },
+	{ "scan_data", run_scan_data, SCAN_LEN, 0 },
+	{ "pack_len6", run_pack6, BENCH_BLKSZ, (BENCH_BLKSZ + DATA_LEN6 - 1) / DATA_LEN6 },
+	{ "pack_len8", run_pack8, BENCH_BLKSZ, BENCH_BLKSZ / DATA_LEN8 },
+	{ "pack_len64", run_pack64, BENCH_BLKSZ, BENCH_BLKSZ / DATA_LEN64 },
+	{ "check_ch_name", run_ch_name, IMAGE_MAX_LEN, 0 },
+	{ "json_feed", run_json, 0, 0 }, /* set up in init_data() */
+};
+
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static void measure(bench_t *b)
+{
+	uint64_t start, t, best = 0;
+	unsigned long n, iter = 1;
+	int run;
+
+	/* find an iteration count which takes at least BENCH_MIN_NS */
+	while (1) {
+		start = now_ns();
+		for (n = 0; n < iter; n++)
+			b->run();
+		if (now_ns() - start >= BENCH_MIN_NS)
+			break;
+		iter *= 2;
+	}
+
+	for (run = 0; run < BENCH_RUNS; run++) {
+		start = now_ns();
+		for (n = 0; n < iter; n++)
+			b->run();
+		t = now_ns() - start;
+		if (!best || t < best)
+			best = t;
+	}
+
+	b->ns_per_byte = (double)best / iter / b->bytes;
+	if (b->frames)
+		b->frames_per_s = 1e9 * iter * b->frames / best;
+}
+
+static int init_data(void)
+{
+	const char *ch_file = get_hw(BENCH_HW_TYPE)->ch_file;
+	uint8_t *data;
+	size_t i, pos;
+	int sv[2];
+
+	/* 16 MB image of pseudo-random content with the ch_filename at the end */
+	data = malloc(IMAGE_MAX_LEN + IMAGE_PAD);
+	empty = malloc(SCAN_LEN);
+	if (!data || !empty) {
+		perror("malloc");
+		return 1;
+	}
+
+	srandom(1);
+	for (i = 0; i < IMAGE_MAX_LEN; i++)
+		data[i] = random();
+	memset(data + IMAGE_MAX_LEN, 0xFF, IMAGE_PAD);
+	memcpy(data + IMAGE_MAX_LEN - HW_NAME_MAX_LEN, ch_file, strlen(ch_file) + 1);
+	memset(empty, 0xFF, SCAN_LEN);
+
+	img.data = data;
+	img.len = IMAGE_MAX_LEN;
+	img.size = IMAGE_MAX_LEN + IMAGE_PAD;
+
+	/* JSON descriptor as provided by a PCAN-Router Pro FD */
+	json_len = snprintf(json, sizeof(json),
+			    "{\"bootloader\": \"2.3.0\", \"firmware\": \"3.1.2\", "
+			    "\"hwType\": \"%d\", \"dataMode\": \"1\", \"canBeReset\": \"1\", "
+			    "\"hardware\": {\"name\": \"%s\", \"id\": \"%d\", "
+			    "\"serial\": \"0x00012345\", \"channels\": [{\"can\": \"1\", "
+			    "\"fd\": \"1\"}, {\"can\": \"2\", \"fd\": \"1\"}]}}",
+			    BENCH_HW_TYPE, get_hw_name(BENCH_HW_TYPE), 5);
+	for (i = 0; i < NUM_BENCHES; i++) {
+		if (benches[i].run == run_json) {
+			benches[i].bytes = json_len;
+			benches[i].frames = (json_len + 4) / 5;
+		}
+	}
+
+	/* the engine only queues the frames of the packing benchmarks */
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	if (engine_init(&eng, sv[0], 0))
+		return 1;
+	eng.fd_frames = 1;
+
+	/* touch all pages before the measurement */
+	for (pos = 0; pos < img.size; pos += 4096)
+		sink += img.data[pos];
+
+	return 0;
+}
+
+static int write_json(const char *path)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+
+	fprintf(f, "{\"benchmarks\": [\n");
+	for (i = 0; i < NUM_BENCHES; i++) {
+		fprintf(f, "  {\"name\": \"%s\", \"bytes\": %zu, \"ns_per_byte\": %.4f",
+			benches[i].name, benches[i].bytes, benches[i].ns_per_byte);
+		if (benches[i].frames)
+			fprintf(f, ", \"frames\": %zu, \"frames_per_s\": %.0f",
+				benches[i].frames, benches[i].frames_per_s);
+		fprintf(f, "}%s\n", (i < NUM_BENCHES - 1) ? "," : "");
+	}
+	fprintf(f, "]}\n");
+
+	if (fclose(f)) {
+		perror(path);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *jsonfile = NULL;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "j:?")) != -1) {
+		switch (opt) {
+		case 'j':
+			jsonfile = optarg;
+			break;
+
+		case '?':
+		default:
+			print_usage(basename(argv[0]));
+			return 1;
+			break;
+		}
+	}
+
+	if (init_data())
+		return 1;
+
+	printf("%-14s %10s %12s\n", "benchmark", "ns/byte", "frames/s");
+	for (i = 0; i < NUM_BENCHES; i++) {
+		measure(&benches[i]);
+		if (benches[i].frames)
+			printf("%-14s %10.4f %12.0f\n", benches[i].name,
+			       benches[i].ns_per_byte, benches[i].frames_per_s);
+		else
+			printf("%-14s %10.4f %12s\n", benches[i].name,
+			       benches[i].ns_per_byte, "-");
+	}
+
+	if (jsonfile && write_json(jsonfile))
+		return 1;
+
+	engine_exit(&eng);
+
+	return 0;
+}
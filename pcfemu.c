@@ -0,0 +1,659 @@
+/*
+ * pcfemu.c - bootloader emulator for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <poll.h>
+#include <signal.h>
+
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "pcanflash.h"
+#include "pcanhw.h"
+
+#define EMU_MAX_BLOCKSIZE 0x10000
+#define EMU_FLASH_SIZE 0x2000000 /* covers flash offset + 16 MB */
+#define EMU_MAX_EVENTS 4096
+#define JSON_MAX_LEN 1024
+
+typedef struct {
+	uint8_t id;
+	uint8_t hw_type;
+	uint8_t hwid;
+	uint8_t status;
+	int json; /* report hw type 250 and provide JSON descriptor */
+	int multi_erase; /* accept contiguous multi-sector erase ranges */
+	int drop_queries; /* number of query requests to be ignored */
+	int json_blksz; /* announce max_blksz in the JSON descriptor */
+	int data_len8; /* accept headerless 8 byte data frames in 6 byte data mode */
+	int ftd_len;
+	uint32_t addr;
+	uint32_t len;
+	uint32_t count;
+	uint32_t frame;
+	uint16_t csum;
+	uint64_t busy_until;
+	int status_pending;
+	uint8_t *flash; /* stored inverted - zero means EMPTY */
+	uint8_t buf[EMU_MAX_BLOCKSIZE];
+} emu_module_t;
+
+typedef struct {
+	uint64_t due;
+	struct can_frame cf;
+} emu_event_t;
+
+static emu_module_t *emu_modules[MAX_MODULES];
+static emu_event_t events[EMU_MAX_EVENTS];
+static int num_events;
+static int s;
+static int verbose;
+static unsigned int erase_ms = 20;
+static unsigned int json_min_gap; /* frames sent faster get lost */
+static unsigned int prog_ms = 1;
+static uint32_t max_blksz = 512; /* largest accepted data block */
+static unsigned int loss; /* per mille */
+static unsigned long rx_frames, lost_frames;
+static char *dump_prefix;
+static unsigned long dump_len;
+static volatile sig_atomic_t running = 1;
+
+static void sigterm(int signo)
+{
+	running = 0;
+}
+
+static void dump_flash(void)
+{
+	char name[256];
+	FILE *f;
+	unsigned long i, offset;
+	int id;
+
+	for (id = 0; id < MAX_MODULES; id++) {
+		if (!emu_modules[id])
+			continue;
+		offset = get_flash_offset(emu_modules[id]->hw_type);
+		if (dump_len > EMU_FLASH_SIZE - offset)
+			dump_len = EMU_FLASH_SIZE - offset;
+		snprintf(name, sizeof(name), "%s%d.bin", dump_prefix, id);
+		f = fopen(name, "w");
+		if (!f)
+			continue;
+		for (i = 0; i < dump_len; i++)
+			fputc((uint8_t)~emu_modules[id]->flash[offset + i], f);
+		fclose(f);
+	}
+}
+
+extern int optind, opterr, optopt;
+
+void print_usage(char *prg)
+{
+	fprintf(stderr, "\nUsage: %s <options> <interface>\n\n", prg);
+	fprintf(stderr, "Options: -m <id>:<hw_type>[:<opts>] (emulate a module - can be given multiple times)\n");
+	fprintf(stderr, "                       j : provide a JSON descriptor (hw type 250)\n");
+	fprintf(stderr, "                       b : announce the max. block size in the JSON descriptor\n");
+	fprintf(stderr, "                       f : CAN FD data mode\n");
+	fprintf(stderr, "                       u : accept 8 byte data frames in 6 byte data mode\n");
+	fprintf(stderr, "                       e : accept multi-sector erase ranges\n");
+	fprintf(stderr, "                       Q : ignore the first module query\n");
+	fprintf(stderr, "         -e <ms>      (erase latency per sector, default 20)\n");
+	fprintf(stderr, "         -p <ms>      (program latency per block, default 1)\n");
+	fprintf(stderr, "         -l <permille> (data frame loss injection)\n");
+	fprintf(stderr, "         -B <bytes>   (largest block size the bootloader accepts, default 512)\n");
+	fprintf(stderr, "         -g <us>      (JSON frames requested with a smaller gap get lost)\n");
+	fprintf(stderr, "         -o <prefix>:<len> (dump len bytes of each flash to <prefix><id>.bin on exit)\n");
+	fprintf(stderr, "         -v           (verbose)\n");
+	fprintf(stderr, "\n");
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void queue_frame(uint64_t due, struct can_frame *cf)
+{
+	int i;
+
+	if (num_events == EMU_MAX_EVENTS) {
+		fprintf(stderr, "event queue overflow!\n");
+		exit(1);
+	}
+
+	/* keep the queue sorted by due time */
+	for (i = num_events; i > 0 && events[i - 1].due > due; i--)
+		events[i] = events[i - 1];
+
+	events[i].due = due;
+	events[i].cf = *cf;
+	num_events++;
+}
+
+static void send_status(emu_module_t *m, uint64_t due)
+{
+	struct can_frame cf;
+
+	memset(&cf, 0, sizeof(cf));
+	cf.can_id = CAN_ID;
+	cf.can_dlc = 6;
+	cf.data[0] = 0x7F;
+	cf.data[1] = 0xFF;
+	cf.data[2] = m->id;
+	cf.data[3] = m->json ? 250 : m->hw_type;
+	cf.data[4] = m->json ? 250 : get_hw(m->hw_type)->flash_id_type;
+	cf.data[5] = m->status;
+
+	queue_frame(due, &cf);
+}
+
+static void send_query_reply(emu_module_t *m)
+{
+	struct can_frame cf;
+
+	memset(&cf, 0, sizeof(cf));
+	cf.can_id = CAN_ID;
+	cf.can_dlc = 8;
+	cf.data[0] = 0xC0 | (m->hwid >> 2);
+	cf.data[1] = (m->hwid << 6) | m->id;
+	cf.data[2] = 0x06;
+	cf.data[3] = 0x17; /* day */
+	cf.data[4] = 0x10; /* month */
+	cf.data[5] = 0x26; /* year */
+	cf.data[6] = (2 << 5) | 3; /* v2.3 */
+
+	queue_frame(now_us() + 200 + m->id * 50, &cf);
+}
+
+static void send_json(emu_module_t *m, unsigned int gap)
+{
+	char json[JSON_MAX_LEN];
+	struct can_frame cf;
+	char extra[64] = "";
+	uint64_t due = now_us();
+	int len, pos;
+	uint8_t sn = 0;
+
+	if (m->json_blksz)
+		snprintf(extra, sizeof(extra), ", \"maxBlockSize\": %u", max_blksz);
+
+	len = snprintf(json, sizeof(json),
+		       "{\"bootloader\": \"2.3.0\", \"firmware\": \"emulated\", "
+		       "\"hwType\": \"%d\", \"dataMode\": \"%d\", \"canBeReset\": \"1\", "
+		       "\"hardware\": {\"name\": \"%s\", \"id\": \"%d\"}%s}",
+		       m->hw_type, (m->ftd_len == DATA_LEN64) ? 2 : (m->ftd_len == DATA_LEN8),
+		       get_hw_name(m->hw_type), m->hwid, extra);
+
+	memset(&cf, 0, sizeof(cf));
+	cf.can_id = CAN_ID;
+	cf.can_dlc = 8;
+	cf.data[0] = 0x7F;
+	cf.data[1] = 0xFF;
+
+	for (pos = 0; pos < len; pos += 5) {
+		memset(&cf.data[3], 0, 5);
+		memcpy(&cf.data[3], &json[pos], (len - pos < 5) ? len - pos : 5);
+
+		if (pos + 5 >= len)
+			cf.data[2] = 0xFF; /* last frame */
+		else
+			cf.data[2] = sn;
+
+		/* rxsn sequence is 0x00 0x01 .. 0xFD 0xFE 0x01 0x02 .. */
+		if (++sn == 0xFF)
+			sn = 1;
+
+		due += gap;
+		if ((gap < json_min_gap) && (pos % 40 == 35))
+			continue; /* receiver overrun */
+		queue_frame(due, &cf);
+	}
+}
+
+/* number of whole sectors of the flash layout in the erase range - 0 when invalid */
+static int erase_sectors(emu_module_t *m)
+{
+	const hw_t *hwt = get_hw(m->hw_type);
+	uint32_t addr = m->addr;
+	int i, n = 0;
+
+	for (i = 0; i < hwt->num_flashblocks; i++) {
+		if (hwt->flashblocks[i].start != addr)
+			continue;
+		addr += hwt->flashblocks[i].len;
+		n++;
+		if (addr - m->addr >= m->len)
+			break;
+	}
+
+	if ((addr - m->addr != m->len) || (n > 1 && !m->multi_erase))
+		return 0;
+
+	return n;
+}
+
+static void handle_cmd(emu_module_t *m, struct can_frame *cf)
+{
+	uint64_t now = now_us();
+	uint32_t val = (cf->data[4] << 16) | (cf->data[5] << 8) | cf->data[6];
+	uint32_t i;
+	int n;
+
+	switch (cf->data[3]) {
+
+	case CAN2FLASH_STATE_REQUEST:
+		if (m->busy_until > now)
+			m->status_pending = 1;
+		else
+			send_status(m, now + 100);
+		return;
+
+	case CAN2FLASH_SET_STARTADDRESS:
+		m->status = SET_STARTADDR;
+		m->addr = val;
+		m->count = 0;
+		m->frame = 0;
+		return;
+
+	case CAN2FLASH_SET_BLOCKSIZE:
+		if (!(m->status & SET_STARTADDR) || (m->addr + val > EMU_FLASH_SIZE))
+			return;
+		m->status |= SET_LENGTH;
+		m->len = val;
+		m->count = 0;
+		m->frame = 0;
+		return;
+
+	case CAN2FLASH_SET_CHECKSUM:
+		if ((m->status & (SET_STARTADDR | SET_LENGTH)) != (SET_STARTADDR | SET_LENGTH))
+			return;
+		m->status |= SET_CHECKSUM;
+		m->csum = (cf->data[4] << 8) | cf->data[5];
+		if ((m->count == m->len) && (m->len <= max_blksz)) {
+			uint16_t csum = 0;
+
+			for (i = 0; i < m->len; i++)
+				csum += m->buf[i];
+			if (csum == m->csum)
+				m->status |= SET_CHECKSUM_OK;
+		}
+		return;
+
+	case CAN2FLASH_ERASE_SECTOR:
+		if ((m->status & (SET_STARTADDR | SET_LENGTH)) != (SET_STARTADDR | SET_LENGTH) ||
+		    (cf->data[4] != 0x55) || !(n = erase_sectors(m)))
+			return;
+		memset(m->flash + m->addr, 0, m->len);
+		m->status |= SET_ERASE_OK;
+		m->busy_until = now + 1000 * erase_ms * n;
+		return;
+
+	case CAN2FLASH_START_PROGRAMMING:
+		if (!(m->status & SET_CHECKSUM_OK) || (cf->data[4] != 0x55))
+			return;
+		/* flash programming can only clear bits */
+		for (i = 0; i < m->len; i++)
+			m->flash[m->addr + i] |= (uint8_t)~m->buf[i];
+		m->status = SET_CHECKSUM_OK;
+		m->busy_until = now + 1000 * prog_ms;
+		return;
+
+	case CAN2FLASH_VERIFY:
+		if (m->len > EMU_MAX_BLOCKSIZE)
+			return;
+		for (i = 0; i < m->len; i++) {
+			if ((uint8_t)~m->flash[m->addr + i] != m->buf[i])
+				return;
+		}
+		m->status |= SET_VERIFY_OK;
+		return;
+
+	case CAN2FLASH_SWITCH_TO_BOOTLOADER:
+	case CAN2FLASH_RESET_REQUEST:
+		if (cf->data[4] != 0x55)
+			return;
+		m->status = 0;
+		m->busy_until = now + 200000;
+		return;
+
+	case CAN2FLASH_END:
+		m->status = 0;
+		return;
+
+	case CAN2FLASH_GET_JSON_DESCRIPTOR:
+		if (m->json)
+			send_json(m, (cf->data[4] << 8) | cf->data[5]);
+		return;
+
+	default:
+		return;
+	}
+}
+
+static void handle_data(const uint8_t *data, int dlen, int fd)
+{
+	emu_module_t *m;
+	int i, j, off, len;
+
+	for (i = 0; i < MAX_MODULES; i++) {
+		m = emu_modules[i];
+
+		/* only the module waiting for block data takes the frame */
+		if (!m || (m->status != (SET_STARTADDR | SET_LENGTH)) ||
+		    (m->count >= m->len) || (m->count >= EMU_MAX_BLOCKSIZE) || (m->busy_until > now_us()))
+			continue;
+
+		/* CAN FD data frames only for modules in CAN FD data mode */
+		if (fd != (m->ftd_len == DATA_LEN64))
+			continue;
+
+		/* headerless 8 byte data frames are accepted besides the header */
+		if (m->ftd_len == DATA_LEN6) {
+			if ((data[0] == 0x7F) && (data[1] == 0xFF))
+				off = 2;
+			else if ((dlen == DATA_LEN8) && m->data_len8)
+				off = 0;
+			else
+				continue;
+		} else
+			off = 0;
+
+		len = dlen - off;
+		if (len > m->len - m->count)
+			len = m->len - m->count;
+
+		for (j = 0; j < len; j++) {
+			uint8_t d = data[off + j];
+
+			if ((m->frame & 1) && has_hw_flags(m->hw_type, FDATA_INVERT))
+				d ^= 0xFF;
+			m->buf[m->count++] = d;
+		}
+		m->frame++;
+	}
+}
+
+static void handle_frame(struct can_frame *cf)
+{
+	int i;
+
+	rx_frames++;
+
+	/* module query */
+	if ((cf->can_dlc == 3) && (cf->data[0] == 0x80) && (cf->data[2] == 0x06)) {
+		for (i = 0; i < MAX_MODULES; i++) {
+			if (!emu_modules[i])
+				continue;
+			if (emu_modules[i]->drop_queries)
+				emu_modules[i]->drop_queries--;
+			else
+				send_query_reply(emu_modules[i]);
+		}
+		return;
+	}
+
+	/* commands */
+	if ((cf->can_dlc == 7) && (cf->data[0] == 0x7F) && (cf->data[1] == 0xFF)) {
+		if (verbose)
+			printf("cmd 0x%02X for module %d\n", cf->data[3], cf->data[2]);
+		if ((cf->data[2] < MAX_MODULES) && emu_modules[cf->data[2]])
+			handle_cmd(emu_modules[cf->data[2]], cf);
+		return;
+	}
+
+	/* block data */
+	if (cf->can_dlc == 8) {
+		if (loss && ((unsigned int)(random() % 1000) < loss)) {
+			lost_frames++;
+			return;
+		}
+		handle_data(cf->data, cf->can_dlc, 0);
+	}
+}
+
+static void process_events(void)
+{
+	uint64_t now = now_us();
+	emu_module_t *m;
+	int i;
+
+	/* deferred status replies of busy modules */
+	for (i = 0; i < MAX_MODULES; i++) {
+		m = emu_modules[i];
+		if (m && m->status_pending && (m->busy_until <= now)) {
+			m->status_pending = 0;
+			send_status(m, now);
+		}
+	}
+
+	while (num_events && (events[0].due <= now)) {
+		if (write(s, &events[0].cf, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
+			perror("write");
+			exit(1);
+		}
+		num_events--;
+		memmove(&events[0], &events[1], num_events * sizeof(emu_event_t));
+	}
+}
+
+static int next_timeout(void)
+{
+	uint64_t now = now_us();
+	uint64_t next = now + 100000;
+	int i;
+
+	if (num_events && (events[0].due < next))
+		next = events[0].due;
+
+	for (i = 0; i < MAX_MODULES; i++) {
+		if (emu_modules[i] && emu_modules[i]->status_pending &&
+		    (emu_modules[i]->busy_until < next))
+			next = emu_modules[i]->busy_until;
+	}
+
+	if (next <= now)
+		return 0;
+
+	return (next - now + 999) / 1000;
+}
+
+static int add_module(char *arg)
+{
+	emu_module_t *m;
+	unsigned int id, hw_type;
+	char opts[8] = "";
+
+	if ((sscanf(arg, "%u:%u:%7s", &id, &hw_type, opts) < 2) ||
+	    (id >= MAX_MODULES) || !get_hw(hw_type) || emu_modules[id])
+		return 1;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return 1;
+
+	m->flash = mmap(NULL, EMU_FLASH_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m->flash == MAP_FAILED)
+		return 1;
+
+	m->id = id;
+	m->hw_type = hw_type;
+	m->hwid = 0x40 + id;
+	m->json = (strchr(opts, 'j') != NULL);
+	m->multi_erase = (strchr(opts, 'e') != NULL);
+	m->drop_queries = (strchr(opts, 'Q') != NULL);
+	m->json_blksz = (strchr(opts, 'b') != NULL);
+	m->data_len8 = (strchr(opts, 'u') != NULL);
+	m->ftd_len = has_hw_flags(hw_type, DATA_MODE8) ? DATA_LEN8 : DATA_LEN6;
+	if (strchr(opts, 'f'))
+		m->ftd_len = DATA_LEN64;
+	emu_modules[id] = m;
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_can addr;
+	struct can_filter rfilter;
+	struct canfd_frame cf;
+	struct pollfd pfd;
+	int opt, ret;
+	int enable_fd = 1;
+
+	while ((opt = getopt(argc, argv, "m:e:p:l:o:g:B:v?")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (add_module(optarg)) {
+				fprintf(stderr, "bad module definition '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'e':
+			erase_ms = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'p':
+			prog_ms = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'l':
+			loss = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'o':
+			dump_prefix = strdup(optarg);
+			if (!dump_prefix || !strchr(dump_prefix, ':')) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			dump_len = strtoul(strchr(dump_prefix, ':') + 1, NULL, 0);
+			*strchr(dump_prefix, ':') = 0;
+			break;
+
+		case 'B':
+			max_blksz = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'g':
+			json_min_gap = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		case '?':
+		default:
+			print_usage(basename(argv[0]));
+			return 1;
+			break;
+		}
+	}
+
+	if ((argc - optind) != 1) {
+		print_usage(basename(argv[0]));
+		return 0;
+	}
+
+	if ((s = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	rfilter.can_id	 = CAN_ID & CAN_SFF_MASK;
+	rfilter.can_mask = (CAN_SFF_MASK|CAN_EFF_FLAG|CAN_RTR_FLAG);
+
+	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, &rfilter, sizeof(rfilter));
+	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable_fd, sizeof(enable_fd));
+
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = if_nametoindex(argv[optind]);
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		return 1;
+	}
+
+	pfd.fd = s;
+	pfd.events = POLLIN;
+
+	signal(SIGTERM, sigterm);
+	signal(SIGINT, sigterm);
+
+	while (running) {
+		ret = poll(&pfd, 1, next_timeout());
+		if (ret < 0) {
+			if (!running)
+				break;
+			perror("poll");
+			return 1;
+		}
+
+		if (pfd.revents & POLLIN) {
+			ret = read(s, &cf, sizeof(cf));
+			if (ret == CAN_MTU)
+				handle_frame((struct can_frame *)&cf);
+			else if (ret == CANFD_MTU) {
+				rx_frames++;
+				if (loss && ((unsigned int)(random() % 1000) < loss))
+					lost_frames++;
+				else
+					handle_data(cf.data, cf.len, 1);
+			} else {
+				perror("read");
+				return 1;
+			}
+		}
+
+		process_events();
+	}
+
+	if (dump_prefix)
+		dump_flash();
+
+	printf("rx %lu frames, %lu lost\n", rx_frames, lost_frames);
+	close(s);
+
+	return 0;
+}
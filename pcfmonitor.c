@@ -53,6 +53,7 @@ void print_usage(char *prg)
 {
 	fprintf(stderr, "\nUsage: %s <options> <interface>\n\n", prg);
 	fprintf(stderr, "Options: -c (color)\n");
+	fprintf(stderr, "         -d (show data frames)\n");
 	fprintf(stderr, "\n");
 }
 
@@ -160,22 +161,43 @@ void print_status(struct can_frame cf, int color)
 	fflush(stdout);
 }
 
+void print_data(struct canfd_frame *cf, int is_fd)
+{
+	int i;
+
+	printf("%s (%d bytes)", is_fd ? "FDData" : "Data", cf->len);
+
+	for (i = 0; i < cf->len; i++)
+		printf("%s%02X", (i % 8) ? "" : " ", cf->data[i]);
+
+	printf("\n");
+
+	fflush(stdout);
+}
+
 int main(int argc, char **argv)
 {
 	int s; /* CAN_RAW socket */
 	struct sockaddr_can addr;
 	struct can_filter rfilter;
+	struct canfd_frame cfd;
 	struct can_frame cf;
 	int opt;
 	int ret;
 	int color = 0;
+	int data = 0;
+	int enable_canfd = 1;
 
-	while ((opt = getopt(argc, argv, "c?")) != -1) {
+	while ((opt = getopt(argc, argv, "cd?")) != -1) {
 		switch (opt) {
 		case 'c':
 			color = 1;
 			break;
 
+		case 'd':
+			data = 1;
+			break;
+
 		case '?':
 		default:
 			print_usage(basename(argv[0]));
@@ -200,6 +222,9 @@ int main(int argc, char **argv)
 
 	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, &rfilter, sizeof(rfilter));
 
+	/* receive CAN FD data frames too (fails on older kernels) */
+	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable_canfd, sizeof(enable_canfd));
+
 	addr.can_family = AF_CAN;
 	addr.can_ifindex = if_nametoindex(argv[optind]);
 
@@ -209,12 +234,25 @@ int main(int argc, char **argv)
 	}
 
 	while (1) {
-		ret = read(s, &cf, sizeof(struct can_frame));
-		if (ret != sizeof(struct can_frame)) {
+		ret = read(s, &cfd, sizeof(struct canfd_frame));
+		if (ret == CANFD_MTU) {
+			if (data)
+				print_data(&cfd, 1);
+			continue;
+		}
+
+		if (ret != CAN_MTU) {
 			perror("read");
 			exit(1);
 		}
 
+		memcpy(&cf, &cfd, sizeof(struct can_frame));
+
+		if ((cf.can_dlc == 8) && data) {
+			print_data(&cfd, 0);
+			continue;
+		}
+
 		if ((cf.can_dlc < 6) || (cf.can_dlc > 7))
 			continue;
 
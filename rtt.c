@@ -0,0 +1,96 @@
+/*
+ * rtt.c - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "rtt.h"
+
+/* monotonic time in us */
+uint64_t rtt_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void rtt_add(rtt_t *rtt, uint32_t us)
+{
+	rtt->us[rtt->pos] = us;
+	rtt->pos = (rtt->pos + 1) % RTT_SAMPLES;
+
+	if (rtt->num < RTT_SAMPLES)
+		rtt->num++;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* percentile of the recent round trip times in us */
+uint32_t rtt_percentile(const rtt_t *rtt, int pct)
+{
+	uint32_t sorted[RTT_SAMPLES];
+
+	if (!rtt->num)
+		return 0;
+
+	memcpy(sorted, rtt->us, rtt->num * sizeof(uint32_t));
+	qsort(sorted, rtt->num, sizeof(uint32_t), cmp_u32);
+
+	return sorted[(rtt->num * pct + 99) / 100 - 1];
+}
+
+/*
+ * Timeout in ms derived from the recent round trip times. The default
+ * is used until enough samples are available.
+ */
+int rtt_timeout(const rtt_t *rtt, int def_ms)
+{
+	uint64_t ms;
+
+	if (rtt->num < RTT_MIN_SAMPLES)
+		return def_ms;
+
+	ms = (uint64_t)rtt_percentile(rtt, RTT_PERCENTILE) * RTT_FACTOR / 1000;
+
+	if (ms < RTT_MIN_TIMEOUT)
+		return RTT_MIN_TIMEOUT;
+
+	if (ms > RTT_MAX_TIMEOUT)
+		return RTT_MAX_TIMEOUT;
+
+	return ms;
+}
@@ -0,0 +1,51 @@
+/*
+ * rtt.h - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __RTTH__
+#define __RTTH__
+
+#include <stdint.h>
+
+#define RTT_SAMPLES 64 /* recent round trip times taken into account */
+#define RTT_MIN_SAMPLES 8 /* samples needed to derive a timeout */
+#define RTT_PERCENTILE 99
+#define RTT_FACTOR 4 /* safety factor for the derived timeout */
+#define RTT_MIN_TIMEOUT 500 /* ms */
+#define RTT_MAX_TIMEOUT 60000 /* ms */
+
+typedef struct {
+	uint32_t us[RTT_SAMPLES];
+	int num; /* number of valid samples */
+	int pos; /* next sample to be replaced */
+} rtt_t;
+
+uint64_t rtt_now(void);
+void rtt_add(rtt_t *rtt, uint32_t us);
+uint32_t rtt_percentile(const rtt_t *rtt, int pct);
+int rtt_timeout(const rtt_t *rtt, int def_ms);
+
+#endif
@@ -0,0 +1,708 @@
+/*
+ * session.c - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <linux/can.h>
+
+#include "pcanflash.h"
+#include "pcanfunc.h"
+#include "pcanhw.h"
+#include "engine.h"
+#include "session.h"
+#include "rtt.h"
+
+/* the module accepts data frames in this state */
+#define DATA_STATE (SET_STARTADDR | SET_LENGTH)
+#define DATA_MASK (SET_STARTADDR | SET_LENGTH | SET_CHECKSUM | SET_ERASE_OK)
+
+/* commands with similar status round trip times */
+enum {
+	RTT_CMD,
+	RTT_DATA,
+	RTT_ERASE,
+	RTT_PROG,
+	RTT_CLASSES
+};
+
+/* the sessions of the modules on one CAN bus */
+struct sessions {
+	engine_t *eng;
+	session_t *sess;
+	int num;
+	session_t *owner; /* the session which may send data frames */
+	rtt_t rtt[RTT_CLASSES]; /* status round trip times of the commands */
+};
+
+void session_init(session_t *sess, uint8_t module_id, uint8_t hw_type, uint8_t ftd_len,
+		  const flashplan_t *plan, int dry_run, int do_reset, int pipeline, int audit)
+{
+	memset(sess, 0, sizeof(*sess));
+	sess->module_id = module_id;
+	sess->hw_type = hw_type;
+	sess->ftd_len = ftd_len;
+	sess->plan = plan;
+	sess->dry_run = dry_run;
+	sess->do_reset = do_reset;
+	sess->pipeline = pipeline && has_hw_flags(hw_type, PIPELINE_BLOCKS);
+	sess->audit = audit;
+	sess->step = STEP_START;
+}
+
+static int first_blk_step(session_t *sess)
+{
+	if (sess->pipeline)
+		return STEP_BLK_PIPE;
+
+	return STEP_BLK_ADDR;
+}
+
+static void begin_reset(session_t *sess)
+{
+	if (has_hw_flags(sess->hw_type, RESET_AFTER_FLASH) || sess->do_reset)
+		sess->step = STEP_RESET;
+	else if (sess->audit && has_hw_flags(sess->hw_type, SWITCH_TO_BOOTLOADER))
+		sess->step = STEP_RESET; /* restart the application after the audit */
+	else
+		sess->step = STEP_DONE;
+}
+
+static void begin_end(session_t *sess)
+{
+	if (sess->check) {
+		printf("\n%scheck: %d of %d unchanged blocks match the flash content\n",
+		       sess->tag, sess->plan->num_blocks - sess->mismatch,
+		       sess->plan->num_blocks);
+		sess->step = STEP_DONE;
+	} else if (sess->audit) {
+		printf("\n%saudit: %d of %d blocks match the image\n", sess->tag,
+		       sess->plan->num_blocks - sess->mismatch, sess->plan->num_blocks);
+		begin_reset(sess);
+	} else if (has_hw_flags(sess->hw_type, END_PROGRAMMING)) /* recent hw modules */
+		sess->step = STEP_END;
+	else
+		begin_reset(sess);
+}
+
+static void begin_write(session_t *sess)
+{
+	if (sess->check)
+		printf("\n%sverifying unchanged flash blocks:\n", sess->tag);
+	else if (sess->audit)
+		printf("\n%sverifying flash blocks:\n", sess->tag);
+	else
+		printf("\n%swriting flash blocks:\n", sess->tag);
+
+	sess->index = 0;
+	if (sess->plan->num_blocks)
+		sess->step = first_blk_step(sess);
+	else
+		begin_end(sess);
+}
+
+static void begin_erase(session_t *sess)
+{
+	printf("\n%serasing flash sectors:\n", sess->tag);
+
+	sess->index = 0;
+	if (sess->plan->num_erase)
+		sess->step = STEP_ERASE_ADDR;
+	else
+		begin_write(sess);
+}
+
+static void next_step(session_t *sess)
+{
+	switch (sess->step) {
+
+	case STEP_START:
+		/* PPCAN mode modules */
+		if (has_hw_flags(sess->hw_type, SWITCH_TO_BOOTLOADER) && !sess->switched)
+			sess->step = STEP_SWITCH;
+		else if (sess->audit)
+			begin_write(sess);
+		else
+			begin_erase(sess);
+		break;
+
+	case STEP_SWITCH:
+		printf("\n%sswitch module into bootloader ... done\n", sess->tag);
+		if (sess->audit)
+			begin_write(sess);
+		else
+			begin_erase(sess);
+		break;
+
+	case STEP_ERASE_LEN:
+		if (!sess->dry_run) {
+			sess->step = STEP_ERASE;
+			break;
+		}
+		/* fallthrough */
+	case STEP_ERASE:
+		if (++sess->index < sess->plan->num_erase)
+			sess->step = STEP_ERASE_ADDR;
+		else
+			begin_write(sess);
+		break;
+
+	case STEP_BLK_PIPE:
+	case STEP_BLK_CSUM:
+		if (sess->audit) {
+			/* compare the flash content with the transferred block */
+			sess->step = STEP_BLK_VERIFY;
+			break;
+		}
+		if (!sess->dry_run) {
+			sess->step = STEP_BLK_PROG;
+			break;
+		}
+		/* fallthrough */
+	case STEP_BLK_VERIFY:
+		if (++sess->index < sess->plan->num_blocks)
+			sess->step = first_blk_step(sess);
+		else
+			begin_end(sess);
+		break;
+
+	case STEP_END:
+		printf("\n%send programming ... done\n", sess->tag);
+		begin_reset(sess);
+		break;
+
+	case STEP_RESET:
+		printf("\n%sreset module ... done\n", sess->tag);
+		sess->step = STEP_DONE;
+		break;
+
+	default:
+		sess->step++;
+		break;
+	}
+}
+
+static void issue_step(session_t *sess);
+
+/* setting the block size enables the reception of (module id less) data frames */
+static int needs_bus(session_t *sess)
+{
+	return (sess->step == STEP_ERASE_LEN) || (sess->step == STEP_BLK_LEN) ||
+		(sess->step == STEP_BLK_PIPE);
+}
+
+static void release_bus(session_t *sess)
+{
+	struct sessions *grp = sess->group;
+	session_t *ss;
+	int i;
+
+	if (grp->owner != sess)
+		return;
+
+	grp->owner = NULL;
+
+	/* hand over the bus to the next waiting session in round robin */
+	for (i = 1; i <= grp->num; i++) {
+		ss = &grp->sess[(sess - grp->sess + i) % grp->num];
+		if (ss->bus_wait) {
+			ss->bus_wait = 0;
+			issue_step(ss);
+			return;
+		}
+	}
+}
+
+static void session_fail(session_t *sess)
+{
+	sess->failed = 1;
+	release_bus(sess);
+}
+
+/* check the module status of the current step - returns an error text */
+static const char *check_status(session_t *sess, uint8_t status)
+{
+	const uint8_t addr_len = SET_STARTADDR | SET_LENGTH;
+
+	switch (sess->step) {
+
+	case STEP_ERASE_ADDR:
+		if ((!sess->dry_run) && ((status & SET_STARTADDR) != SET_STARTADDR))
+			return "erase1";
+		break;
+
+	case STEP_ERASE_LEN:
+		if ((!sess->dry_run) && ((status & addr_len) != addr_len))
+			return "erase2";
+		break;
+
+	case STEP_ERASE:
+		if ((status & SET_ERASE_OK) != SET_ERASE_OK)
+			return "erase3";
+		break;
+
+	case STEP_BLK_ADDR:
+		if ((status & SET_STARTADDR) != SET_STARTADDR)
+			return "flash1";
+		break;
+
+	case STEP_BLK_LEN:
+		if ((status & addr_len) != addr_len)
+			return "flash2";
+		break;
+
+	case STEP_BLK_DATA:
+		if ((status & addr_len) != addr_len)
+			return "flash3";
+		break;
+
+	case STEP_BLK_PIPE:
+	case STEP_BLK_CSUM:
+		if (status != (SET_CHECKSUM_OK | addr_len | SET_CHECKSUM))
+			return "flash4";
+		break;
+
+	case STEP_BLK_PROG:
+		if (status != SET_CHECKSUM_OK)
+			return "flash5";
+		break;
+
+	case STEP_BLK_VERIFY:
+		if (sess->audit) {
+			/* the verify result is reported per block */
+			if (!(status & SET_CHECKSUM_OK))
+				return "verify";
+			break;
+		}
+		if (status != (SET_CHECKSUM_OK | SET_VERIFY_OK))
+			return "flash6";
+		break;
+	}
+
+	return NULL;
+}
+
+static void report_block(session_t *sess, int match)
+{
+	const plan_block_t *blk = &sess->plan->blocks[sess->index];
+
+	if (!match)
+		sess->mismatch++;
+
+	/* the check only reports the differing blocks */
+	if (sess->check && match)
+		return;
+
+	printf("%sblock at offset 0x%X with csum 0x%04X %s\n", sess->tag,
+	       (unsigned int)blk->addr, (unsigned int)blk->csum,
+	       match ? "matches" : "DIFFERS");
+}
+
+static int rtt_class(session_t *sess)
+{
+	switch (sess->step) {
+
+	case STEP_ERASE:
+		return RTT_ERASE;
+
+	case STEP_BLK_DATA:
+	case STEP_BLK_PIPE:
+		return RTT_DATA;
+
+	case STEP_BLK_PROG:
+		return RTT_PROG;
+	}
+
+	return RTT_CMD;
+}
+
+/* trace phase of the current step */
+static int trace_phase(session_t *sess)
+{
+	switch (sess->step) {
+
+	case STEP_SWITCH:
+		return TRACE_SWITCH;
+
+	case STEP_ERASE_ADDR:
+		return TRACE_ERASE_ADDR;
+
+	case STEP_ERASE_LEN:
+		return TRACE_ERASE_LEN;
+
+	case STEP_ERASE:
+		return TRACE_ERASE;
+
+	case STEP_BLK_ADDR:
+		return TRACE_BLK_ADDR;
+
+	case STEP_BLK_LEN:
+		return TRACE_BLK_LEN;
+
+	case STEP_BLK_DATA:
+		return TRACE_BLK_DATA;
+
+	case STEP_BLK_CSUM:
+		return TRACE_BLK_CSUM;
+
+	case STEP_BLK_PROG:
+		return TRACE_BLK_PROG;
+
+	case STEP_BLK_VERIFY:
+		return TRACE_BLK_VERIFY;
+
+	case STEP_BLK_PIPE:
+		return TRACE_BLK_PIPE;
+
+	case STEP_END:
+		return TRACE_END;
+	}
+
+	return TRACE_RESET;
+}
+
+/* record the current step from issuing its command until now */
+static void trace_step(session_t *sess)
+{
+	const flashplan_t *plan = sess->plan;
+	uint32_t addr = 0;
+	uint32_t bytes = 0;
+
+	if (!sess->trace)
+		return;
+
+	switch (sess->step) {
+
+	case STEP_ERASE_ADDR:
+	case STEP_ERASE_LEN:
+	case STEP_ERASE:
+		addr = plan->erase[sess->index].start;
+		break;
+
+	case STEP_BLK_DATA:
+	case STEP_BLK_PIPE:
+		bytes = plan->blksz;
+		/* fallthrough */
+	case STEP_BLK_ADDR:
+	case STEP_BLK_LEN:
+	case STEP_BLK_CSUM:
+	case STEP_BLK_PROG:
+	case STEP_BLK_VERIFY:
+		addr = plan->blocks[sess->index].addr;
+		break;
+	}
+
+	trace_add(sess->trace, sess->bus, sess->module_id, trace_phase(sess), sess->issued,
+		  addr, bytes);
+}
+
+/* erase round trip times are taken per sector */
+static int erase_sectors(session_t *sess)
+{
+	if (sess->step == STEP_ERASE)
+		return sess->plan->erase[sess->index].sectors;
+
+	return 1;
+}
+
+/* status timeout derived from the round trip times of this kind of command */
+static int status_timeout(session_t *sess)
+{
+	const rtt_t *rtt = &sess->group->rtt[rtt_class(sess)];
+	int def = get_erase_timeout(sess->hw_type);
+	int timeout;
+
+	if (sess->step != STEP_ERASE)
+		return rtt_timeout(rtt, STATUS_TIMEOUT);
+
+	/* slow erases never get a shorter timeout than the default */
+	if (!def)
+		def = STATUS_TIMEOUT;
+
+	timeout = rtt_timeout(rtt, def);
+	if (timeout < def)
+		timeout = def;
+
+	return timeout * erase_sectors(sess);
+}
+
+/* completion of the status request of the current step */
+static void session_status(void *ctx, int err, const struct can_frame *cf)
+{
+	session_t *sess = ctx;
+	const char *msg;
+	uint8_t status;
+
+	if (err) {
+		if (err == ENGINE_TIMEOUT)
+			fprintf(stderr, "%stimeout in get_status process!\n", sess->tag);
+		session_fail(sess);
+		return;
+	}
+
+	/* the frames queued before the status request do not count */
+	if (!sess->polling)
+		rtt_add(&sess->group->rtt[rtt_class(sess)],
+			(rtt_now() - engine_sent(sess->group->eng, sess->module_id)) /
+			erase_sectors(sess));
+	sess->polling = 0;
+
+	trace_step(sess);
+
+	status = cf->data[5];
+	msg = check_status(sess, status);
+
+	/* retry this block and all following blocks in the strict sequence */
+	if (msg && (sess->step == STEP_BLK_PIPE)) {
+		printf("%spipelined transfer got status %02X - switching to strict mode\n",
+		       sess->tag, status);
+		sess->pipeline = 0;
+		sess->step = STEP_BLK_ADDR;
+		release_bus(sess);
+		issue_step(sess);
+		return;
+	}
+
+	if (msg) {
+		fprintf(stderr, "%s%s - wrong status %02X!\n", sess->tag, msg, status);
+		session_fail(sess);
+		return;
+	}
+
+	if (sess->audit && (sess->step == STEP_BLK_VERIFY))
+		report_block(sess, status & SET_VERIFY_OK);
+
+	next_step(sess);
+
+	/* release the bus when leaving the data state */
+	if (((status & DATA_MASK) != DATA_STATE) || (sess->step == STEP_DONE))
+		release_bus(sess);
+
+	if (sess->step != STEP_DONE)
+		issue_step(sess);
+}
+
+/*
+ * Poll the module status after switch, end and reset until the module
+ * replies. The poll interval is doubled with every unanswered request.
+ */
+static void session_poll(void *ctx, int err, const struct can_frame *cf)
+{
+	session_t *sess = ctx;
+
+	if ((err == ENGINE_TIMEOUT) && (rtt_now() < sess->issued + SETTLE_TIMEOUT * 1000ULL)) {
+		sess->poll_ms *= 2;
+		if (sess->poll_ms > POLL_MAX)
+			sess->poll_ms = POLL_MAX;
+
+		if (engine_status(sess->group->eng, sess->module_id, sess->poll_ms,
+				  session_poll, sess))
+			session_fail(sess);
+		return;
+	}
+
+	session_status(ctx, err, cf);
+}
+
+/* queue the command of the current step and request the module status */
+static void issue_step(session_t *sess)
+{
+	struct sessions *grp = sess->group;
+	engine_t *eng = grp->eng;
+	const flashplan_t *plan = sess->plan;
+	const plan_erase_t *erase = &plan->erase[sess->index];
+	const plan_block_t *blk = &plan->blocks[sess->index];
+	uint8_t id = sess->module_id;
+	int ret = 0;
+
+	if (needs_bus(sess)) {
+		if (grp->owner && (grp->owner != sess)) {
+			sess->bus_wait = 1;
+			return;
+		}
+		grp->owner = sess;
+	}
+
+	sess->issued = rtt_now();
+
+	switch (sess->step) {
+
+	case STEP_START:
+		next_step(sess);
+		issue_step(sess);
+		return;
+
+	case STEP_SWITCH:
+		ret = switch_to_bootloader(eng, id);
+		goto poll;
+
+	case STEP_ERASE_ADDR:
+		printf("%serasing block at startaddr 0x%06X with block size 0x%06X\n",
+		       sess->tag, (unsigned int)erase->start, (unsigned int)erase->len);
+		ret = set_startaddress(eng, id, erase->start);
+		break;
+
+	case STEP_ERASE_LEN:
+		ret = set_blocksize(eng, id, erase->len);
+		break;
+
+	case STEP_ERASE:
+		ret = erase_sector(eng, id);
+		/* the module leaves the data state with the erase command */
+		if (!ret)
+			release_bus(sess);
+		break;
+
+	case STEP_BLK_ADDR:
+		if (!sess->audit)
+			printf("%swriting non empty block at offset 0x%X with csum 0x%04X\n",
+			       sess->tag, (unsigned int)blk->addr, (unsigned int)blk->csum);
+		ret = set_startaddress(eng, id, blk->addr);
+		break;
+
+	case STEP_BLK_LEN:
+		ret = set_blocksize(eng, id, plan->blksz);
+		break;
+
+	case STEP_BLK_PIPE:
+		if (!sess->audit)
+			printf("%swriting non empty block at offset 0x%X with csum 0x%04X\n",
+			       sess->tag, (unsigned int)blk->addr, (unsigned int)blk->csum);
+		ret = set_startaddress(eng, id, blk->addr);
+		if (!ret)
+			ret = set_blocksize(eng, id, plan->blksz);
+		if (!ret)
+			ret = send_block_data(eng, blk->data, plan->blksz,
+					      has_hw_flags(sess->hw_type, FDATA_INVERT),
+					      sess->ftd_len);
+		if (!ret)
+			ret = set_checksum(eng, id, blk->csum);
+		break;
+
+	case STEP_BLK_DATA:
+		ret = send_block_data(eng, blk->data, plan->blksz,
+				      has_hw_flags(sess->hw_type, FDATA_INVERT), sess->ftd_len);
+		break;
+
+	case STEP_BLK_CSUM:
+		ret = set_checksum(eng, id, blk->csum);
+		break;
+
+	case STEP_BLK_PROG:
+		ret = start_programming(eng, id);
+		break;
+
+	case STEP_BLK_VERIFY:
+		ret = verify(eng, id);
+		break;
+
+	case STEP_END:
+		ret = end_programming(eng, id);
+		goto poll;
+
+	case STEP_RESET:
+		ret = reset_module(eng, id);
+
+		/*
+		 * a reset which is issued by a command line option
+		 * likely leads into starting the application which
+		 * does not know about this status message. Therefore
+		 * only get the status when this is used in an original
+		 * PCAN flashing process, e.g. the PCAN Router Pro
+		 */
+		if (!ret && !has_hw_flags(sess->hw_type, RESET_AFTER_FLASH)) {
+			trace_step(sess);
+			next_step(sess);
+			return;
+		}
+		goto poll;
+	}
+
+	if (!ret)
+		ret = engine_status(eng, id, status_timeout(sess), session_status, sess);
+
+	if (ret)
+		session_fail(sess);
+
+	return;
+
+poll:
+	sess->polling = 1;
+	sess->poll_ms = POLL_MIN;
+
+	if (!ret)
+		ret = engine_status(eng, id, sess->poll_ms, session_poll, sess);
+
+	if (ret)
+		session_fail(sess);
+}
+
+/*
+ * Run the flash sessions of several modules on the same CAN bus.
+ *
+ * While one module waits for its erase or programming, the others can
+ * transfer their data. As the data frames carry no module id only one
+ * module at a time may be in the state to accept data frames (DATA_STATE).
+ * This module owns the bus until its status leaves this state or until
+ * its erase command is queued.
+ *
+ * The sessions are driven by the completions of the protocol engine.
+ * Returns the number of failed sessions - in audit mode this includes
+ * the modules whose flash content differs from the image.
+ */
+int run_sessions(engine_t *eng, session_t *sess, int num)
+{
+	struct sessions grp;
+	int failed = 0;
+	int i;
+
+	memset(&grp, 0, sizeof(grp));
+	grp.eng = eng;
+	grp.sess = sess;
+	grp.num = num;
+
+	for (i = 0; i < num; i++)
+		sess[i].group = &grp;
+
+	/* e.g. a module which failed the check of its unchanged blocks */
+	for (i = 0; i < num; i++) {
+		if (!sess[i].failed)
+			issue_step(&sess[i]);
+	}
+
+	engine_run(eng);
+
+	for (i = 0; i < num; i++) {
+		if (sess[i].failed || sess[i].mismatch || (sess[i].step != STEP_DONE))
+			failed++;
+	}
+
+	return failed;
+}
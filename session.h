@@ -0,0 +1,87 @@
+/*
+ * session.h - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __SESSIONH__
+#define __SESSIONH__
+
+#include <stdint.h>
+#include "flashplan.h"
+#include "engine.h"
+#include "trace.h"
+
+#define SESSION_TAG_LEN 32
+
+/* protocol steps of a flash session */
+enum {
+	STEP_START,
+	STEP_SWITCH,
+	STEP_ERASE_ADDR,
+	STEP_ERASE_LEN,
+	STEP_ERASE,
+	STEP_BLK_ADDR,
+	STEP_BLK_LEN,
+	STEP_BLK_DATA,
+	STEP_BLK_CSUM,
+	STEP_BLK_PROG,
+	STEP_BLK_VERIFY,
+	STEP_BLK_PIPE, /* addr, len, data and csum without intermediate status */
+	STEP_END,
+	STEP_RESET,
+	STEP_DONE
+};
+
+typedef struct {
+	uint8_t module_id;
+	uint8_t hw_type;
+	uint8_t ftd_len;
+	int dry_run;
+	int do_reset;
+	int pipeline; /* pipelined block transfer */
+	int audit; /* verify the flash content without erasing and programming */
+	int switched; /* the module already runs the bootloader */
+	int check; /* audit of the blocks a differential plan skips - ends in the bootloader */
+	const flashplan_t *plan;
+	char tag[SESSION_TAG_LEN]; /* prefix for the output of this session */
+
+	int step;
+	int index; /* index of the current erase sector or block */
+	int bus_wait; /* waiting for another module to finish its data transfer */
+	int failed;
+	int mismatch; /* number of blocks which failed the verification in audit mode */
+	uint64_t issued; /* time of the last command in us */
+	int polling; /* waiting for the module after switch, end and reset */
+	int poll_ms;
+	struct sessions *group; /* all sessions on this CAN bus */
+	trace_t *trace; /* timing of the protocol steps - NULL when not tracing */
+	int bus; /* bus index in the trace */
+} session_t;
+
+void session_init(session_t *sess, uint8_t module_id, uint8_t hw_type, uint8_t ftd_len,
+		  const flashplan_t *plan, int dry_run, int do_reset, int pipeline, int audit);
+int run_sessions(engine_t *eng, session_t *sess, int num);
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * trace.c - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "pcanhw.h"
+#include "trace.h"
+#include "rtt.h"
+
+#define TRACE_GROW 4096 /* events */
+
+static const char *phase_name[TRACE_PHASES] = {
+	[TRACE_DISCOVERY] = "discovery",
+	[TRACE_DESCRIPTOR] = "descriptor",
+	[TRACE_PROBE] = "probe",
+	[TRACE_CALIB] = "calibrate",
+	[TRACE_SWITCH] = "switch",
+	[TRACE_ERASE_ADDR] = "erase_addr",
+	[TRACE_ERASE_LEN] = "erase_len",
+	[TRACE_ERASE] = "erase",
+	[TRACE_BLK_ADDR] = "block_addr",
+	[TRACE_BLK_LEN] = "block_len",
+	[TRACE_BLK_DATA] = "block_data",
+	[TRACE_BLK_CSUM] = "block_csum",
+	[TRACE_BLK_PROG] = "block_prog",
+	[TRACE_BLK_VERIFY] = "block_verify",
+	[TRACE_BLK_PIPE] = "block_pipe",
+	[TRACE_END] = "end",
+	[TRACE_RESET] = "reset",
+};
+
+/* time span and transferred data of a module */
+typedef struct {
+	uint64_t first;
+	uint64_t last;
+	uint64_t bytes;
+} trace_span_t;
+
+void trace_init(trace_t *tr)
+{
+	memset(tr, 0, sizeof(*tr));
+	pthread_mutex_init(&tr->lock, NULL);
+	tr->start = rtt_now();
+}
+
+/* the functions which record events accept tr == NULL when not tracing */
+void trace_bus(trace_t *tr, int bus, const char *ifname)
+{
+	if (!tr || (bus < 0) || (bus >= TRACE_MAX_BUSES))
+		return;
+
+	strncpy(tr->bus_name[bus], ifname, IFNAMSIZ - 1);
+}
+
+/* record a phase which started at start (us) and ends now */
+void trace_add(trace_t *tr, int bus, uint8_t module_id, int phase, uint64_t start,
+	       uint32_t addr, uint32_t bytes)
+{
+	uint64_t now = rtt_now();
+	trace_event_t *ev;
+
+	if (!tr || (bus < 0) || (bus >= TRACE_MAX_BUSES))
+		return;
+
+	pthread_mutex_lock(&tr->lock);
+
+	if (tr->num == tr->size) {
+		ev = realloc(tr->ev, (tr->size + TRACE_GROW) * sizeof(trace_event_t));
+		if (!ev) {
+			/* tracing must not break the flash process */
+			pthread_mutex_unlock(&tr->lock);
+			return;
+		}
+		tr->ev = ev;
+		tr->size += TRACE_GROW;
+	}
+
+	ev = &tr->ev[tr->num++];
+	ev->start = start;
+	ev->dur = now - start;
+	ev->addr = addr;
+	ev->bytes = bytes;
+	ev->phase = phase;
+	ev->bus = bus;
+	ev->module_id = module_id;
+
+	pthread_mutex_unlock(&tr->lock);
+}
+
+/* the throughput only counts the block data which is flashed or verified */
+static uint32_t block_bytes(const trace_event_t *ev)
+{
+	if ((ev->phase == TRACE_BLK_DATA) || (ev->phase == TRACE_BLK_PIPE))
+		return ev->bytes;
+
+	return 0;
+}
+
+static FILE *open_out(const char *path)
+{
+	FILE *f;
+
+	if (!strcmp(path, "-"))
+		return stdout;
+
+	f = fopen(path, "w");
+	if (!f)
+		perror(path);
+
+	return f;
+}
+
+static int close_out(FILE *f, const char *path)
+{
+	if (f == stdout)
+		return fflush(f);
+
+	if (fclose(f)) {
+		perror(path);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, int num, int pct)
+{
+	return sorted[(num * pct + 99) / 100 - 1];
+}
+
+static void print_phases(FILE *f, const trace_t *tr, uint32_t *dur)
+{
+	uint64_t total;
+	int phase, num, i;
+	int first = 1;
+
+	fprintf(f, "  \"phases\": [");
+
+	for (phase = 0; phase < TRACE_PHASES; phase++) {
+		total = 0;
+		num = 0;
+		for (i = 0; i < tr->num; i++) {
+			if (tr->ev[i].phase != phase)
+				continue;
+			dur[num++] = tr->ev[i].dur;
+			total += tr->ev[i].dur;
+		}
+
+		if (!num)
+			continue;
+
+		qsort(dur, num, sizeof(uint32_t), cmp_u32);
+
+		fprintf(f, "%s\n    {\"name\": \"%s\", \"count\": %d, \"total_ms\": %.3f, "
+			"\"p50_us\": %u, \"p90_us\": %u, \"p99_us\": %u, \"max_us\": %u}",
+			first ? "" : ",", phase_name[phase], num, total / 1000.0,
+			percentile(dur, num, 50), percentile(dur, num, 90),
+			percentile(dur, num, 99), dur[num - 1]);
+		first = 0;
+	}
+
+	fprintf(f, "\n  ],\n");
+}
+
+static void print_modules(FILE *f, const trace_t *tr, trace_span_t *span)
+{
+	trace_span_t *s;
+	uint64_t end, us;
+	int bus, id, i;
+	int first = 1;
+
+	for (i = 0; i < tr->num; i++) {
+		if (tr->ev[i].module_id >= MAX_MODULES)
+			continue;
+
+		s = &span[tr->ev[i].bus * MAX_MODULES + tr->ev[i].module_id];
+		end = tr->ev[i].start + tr->ev[i].dur;
+		if (!s->first || (tr->ev[i].start < s->first))
+			s->first = tr->ev[i].start;
+		if (end > s->last)
+			s->last = end;
+		s->bytes += block_bytes(&tr->ev[i]);
+	}
+
+	fprintf(f, "  \"modules\": [");
+
+	for (bus = 0; bus < TRACE_MAX_BUSES; bus++) {
+		for (id = 0; id < MAX_MODULES; id++) {
+			s = &span[bus * MAX_MODULES + id];
+			if (!s->first)
+				continue;
+
+			us = s->last - s->first;
+			fprintf(f, "%s\n    {\"bus\": \"%s\", \"module_id\": %d, \"total_ms\": %.3f, "
+				"\"bytes\": %llu, \"bytes_per_s\": %.0f}",
+				first ? "" : ",", tr->bus_name[bus], id, us / 1000.0,
+				(unsigned long long)s->bytes,
+				us ? s->bytes * 1e6 / us : 0.0);
+			first = 0;
+		}
+	}
+
+	fprintf(f, "\n  ]\n");
+}
+
+/*
+ * Write the totals, the throughput and the duration percentiles of each
+ * phase as JSON. The duration of a protocol step is the round trip time
+ * of its command up to the status reply.
+ */
+int trace_summary(trace_t *tr, const char *path)
+{
+	uint64_t wall = rtt_now() - tr->start;
+	uint64_t bytes = 0;
+	trace_span_t *span;
+	uint32_t *dur;
+	FILE *f;
+	int i;
+
+	dur = malloc((tr->num + 1) * sizeof(uint32_t));
+	span = calloc(TRACE_MAX_BUSES * MAX_MODULES, sizeof(trace_span_t));
+	if (!dur || !span) {
+		perror("malloc");
+		free(dur);
+		free(span);
+		return 1;
+	}
+
+	for (i = 0; i < tr->num; i++)
+		bytes += block_bytes(&tr->ev[i]);
+
+	f = open_out(path);
+	if (!f) {
+		free(dur);
+		free(span);
+		return 1;
+	}
+
+	fprintf(f, "{\n  \"total_ms\": %.3f,\n  \"bytes\": %llu,\n  \"bytes_per_s\": %.0f,\n",
+		wall / 1000.0, (unsigned long long)bytes, wall ? bytes * 1e6 / wall : 0.0);
+	print_phases(f, tr, dur);
+	print_modules(f, tr, span);
+	fprintf(f, "}\n");
+
+	free(dur);
+	free(span);
+
+	return close_out(f, path);
+}
+
+/* write the events in the Chrome trace event format (chrome://tracing) */
+int trace_chrome(trace_t *tr, const char *path)
+{
+	uint8_t used[TRACE_MAX_BUSES][MAX_MODULES + 1];
+	const trace_event_t *ev;
+	int bus, id, i;
+	FILE *f;
+
+	f = open_out(path);
+	if (!f)
+		return 1;
+
+	memset(used, 0, sizeof(used));
+	for (i = 0; i < tr->num; i++)
+		used[tr->ev[i].bus][tr->ev[i].module_id] = 1;
+
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+	/* one process per CAN bus and one thread per module */
+	for (bus = 0; bus < TRACE_MAX_BUSES; bus++) {
+		for (id = 0; id <= MAX_MODULES; id++) {
+			if (!used[bus][id])
+				continue;
+			fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+				"\"args\": {\"name\": \"%s\"}},\n", bus, tr->bus_name[bus]);
+			break;
+		}
+		for (id = 0; id <= MAX_MODULES; id++) {
+			if (!used[bus][id])
+				continue;
+			if (id == NO_MODULE_ID)
+				fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+					"\"tid\": %d, \"args\": {\"name\": \"bus\"}},\n", bus, id);
+			else
+				fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+					"\"tid\": %d, \"args\": {\"name\": \"module %d\"}},\n",
+					bus, id, id);
+		}
+	}
+
+	for (i = 0; i < tr->num; i++) {
+		ev = &tr->ev[i];
+		fprintf(f, "{\"name\": \"%s\", \"cat\": \"pcanflash\", \"ph\": \"X\", "
+			"\"ts\": %llu, \"dur\": %u, \"pid\": %d, \"tid\": %d, "
+			"\"args\": {\"addr\": \"0x%X\", \"bytes\": %u}}%s\n",
+			phase_name[ev->phase], (unsigned long long)(ev->start - tr->start),
+			ev->dur, ev->bus, ev->module_id, ev->addr, ev->bytes,
+			(i < tr->num - 1) ? "," : "");
+	}
+
+	fprintf(f, "]}\n");
+
+	return close_out(f, path);
+}
+
+void trace_free(trace_t *tr)
+{
+	free(tr->ev);
+	pthread_mutex_destroy(&tr->lock);
+	memset(tr, 0, sizeof(*tr));
+}
@@ -0,0 +1,86 @@
+/*
+ * trace.h - flash program for PCAN routers
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Author: Oliver Hartkopp (socketcan@hartkopp.net)
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __TRACEH__
+#define __TRACEH__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <net/if.h>
+
+#define TRACE_MAX_BUSES 64
+
+/* timed phases of a flash run */
+enum {
+	TRACE_DISCOVERY,
+	TRACE_DESCRIPTOR,
+	TRACE_PROBE,
+	TRACE_CALIB,
+	TRACE_SWITCH,
+	TRACE_ERASE_ADDR,
+	TRACE_ERASE_LEN,
+	TRACE_ERASE,
+	TRACE_BLK_ADDR,
+	TRACE_BLK_LEN,
+	TRACE_BLK_DATA,
+	TRACE_BLK_CSUM,
+	TRACE_BLK_PROG,
+	TRACE_BLK_VERIFY,
+	TRACE_BLK_PIPE,
+	TRACE_END,
+	TRACE_RESET,
+	TRACE_PHASES
+};
+
+typedef struct {
+	uint64_t start; /* us */
+	uint32_t dur; /* us */
+	uint32_t addr; /* erase sector or block address */
+	uint32_t bytes; /* transferred block data */
+	uint8_t phase;
+	uint8_t bus;
+	uint8_t module_id; /* NO_MODULE_ID for the phases of the bus */
+} trace_event_t;
+
+typedef struct {
+	trace_event_t *ev;
+	int num;
+	int size;
+	uint64_t start; /* us */
+	char bus_name[TRACE_MAX_BUSES][IFNAMSIZ];
+	pthread_mutex_t lock;
+} trace_t;
+
+void trace_init(trace_t *tr);
+void trace_bus(trace_t *tr, int bus, const char *ifname);
+void trace_add(trace_t *tr, int bus, uint8_t module_id, int phase, uint64_t start,
+	       uint32_t addr, uint32_t bytes);
+int trace_summary(trace_t *tr, const char *path);
+int trace_chrome(trace_t *tr, const char *path);
+void trace_free(trace_t *tr);
+
+#endif